@@ -1,9 +1,33 @@
 #include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define HAVE_MMAP 0
+#endif
+
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_ttf.h>
@@ -12,6 +36,15 @@
 #include <emscripten.h>
 #endif
 
+// Worker threads are available natively, and under Emscripten only when
+// built with -pthread (which needs SharedArrayBuffer in the browser). The
+// web page picks a build the browser can run; see web/index.html.
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define HAVE_THREADS 1
+#else
+#define HAVE_THREADS 0
+#endif
+
 #define FR(i,a,b) for(int i=(a);i<(b);++i)
 #define FOR(i,n) FR(i,0,n)
 #define BEND(v) (v).begin(),(v).end()
@@ -54,663 +87,5863 @@ void failIMG(const char * msg)
 }
 #define CHECK_IMG(expr) if ((expr) < 0) failIMG(#expr)
 
-void DrawText(SDL_Renderer * ren, TTF_Font * font, const char * s, SDL_Color color, int x, int y, int * textW, int * textH, bool center = false)
-{
-    int tW, tH;
-    if (textW == NULL) textW = &tW;
-    if (textH == NULL) textH = &tH;
-
-    sdl_ptr<SDL_Surface> textSurf(TTF_RenderText_Solid(font, s, color));
-    if (!textSurf) failTTF("TTF_RenderText_Solid");
+// Glyph atlas: the printable ASCII range rasterized once into one texture,
+// so drawing a string is one SDL_RenderCopy per glyph and no rasterization.
+const int GLYPH_FIRST = 32;
+const int GLYPH_LAST = 126;
+const int GLYPH_ATLAS_WIDTH = 512;
 
-    sdl_ptr<SDL_Texture> textTex(SDL_CreateTextureFromSurface(ren, textSurf.get()));
-    if (!textTex) failSDL("SDL_CreateTextureFromSurface");
+struct Glyph
+{
+    SDL_Rect src; // in the atlas texture
+    int advance;
+};
 
-    if (SDL_QueryTexture(textTex.get(), NULL, NULL, textW, textH) < 0) failSDL("SDL_QueryTexture");
+const int GLYPH_COUNT = GLYPH_LAST - GLYPH_FIRST + 1;
 
-    if (center) {
-        x -= *textW / 2;
-        y -= *textH / 2;
+struct GlyphAtlas
+{
+    sdl_ptr<SDL_Texture> tex;
+    Glyph glyphs[GLYPH_COUNT];
+    int height;
+    int line_skip;
+    int w, h;
+    Uint32 const * pixels; // RGBA8888, row-major, in pixel_storage or the asset pack
+    std::vector<Uint32> pixel_storage;
+
+    Glyph const * glyph(char c) const
+    {
+        if (c < GLYPH_FIRST || GLYPH_LAST < c) c = '?';
+        return &glyphs[c - GLYPH_FIRST];
     }
+};
 
-    SDL_Rect dst = { x, y, *textW, *textH };
-    if (SDL_RenderCopy(ren, textTex.get(), NULL, &dst) < 0) failSDL("SDL_RenderCopy");
-}
-
-SDL_Texture * LoadTexture(SDL_Renderer * ren, const char * path)
+// Rasterize the atlas pixels; UploadGlyphAtlas() makes the texture.
+void BuildGlyphAtlas(GlyphAtlas & atlas, TTF_Font * font)
 {
-    SDL_Texture *tex = IMG_LoadTexture(ren, path);
-    if (!tex) failIMG("LoadTexture");
-    return tex;
-}
-
-// SDL data, cleanup, etc.
-SDL_Window * win = NULL;
-TTF_Font * font = NULL;
-SDL_Renderer * ren = NULL;
+    SDL_Color white = {255, 255, 255, 255};
+    atlas.height = TTF_FontHeight(font);
+    atlas.line_skip = TTF_FontLineSkip(font);
 
-sdl_ptr<SDL_Texture> pixel_screen;
+    std::vector<sdl_ptr<SDL_Surface>> glyphSurfs;
+    int pen_x = 0;
+    int pen_y = 0;
+    FR(c, GLYPH_FIRST, GLYPH_LAST+1) {
+        Glyph & g = atlas.glyphs[c - GLYPH_FIRST];
 
-sdl_ptr<SDL_Texture> red_brick;
-sdl_ptr<SDL_Texture> green_brick;
-sdl_ptr<SDL_Texture> red_panel;
-sdl_ptr<SDL_Texture> green_panel;
-sdl_ptr<SDL_Texture> red_2panel;
-sdl_ptr<SDL_Texture> green_2panel;
+        sdl_ptr<SDL_Surface> glyphSurf(TTF_RenderGlyph_Blended(font, c, white));
+        if (!glyphSurf) failTTF("TTF_RenderGlyph_Blended");
 
-sdl_ptr<SDL_Texture> frog_sprite;
+        int minx, maxx, miny, maxy;
+        if (TTF_GlyphMetrics(font, c, &minx, &maxx, &miny, &maxy, &g.advance) < 0) g.advance = glyphSurf->w;
 
-void cleanup()
-{
-    red_brick.reset();
-    green_brick.reset();
-    red_panel.reset();
-    green_panel.reset();
-    red_2panel.reset();
-    green_2panel.reset();
+        if (pen_x + glyphSurf->w > GLYPH_ATLAS_WIDTH) {
+            pen_x = 0;
+            pen_y += atlas.height;
+        }
+        g.src.x = pen_x;
+        g.src.y = pen_y;
+        g.src.w = glyphSurf->w;
+        g.src.h = glyphSurf->h;
+        pen_x += glyphSurf->w;
 
-    frog_sprite.reset();
+        glyphSurfs.push_back(std::move(glyphSurf));
+    }
 
-    pixel_screen.reset();
+    atlas.w = GLYPH_ATLAS_WIDTH;
+    atlas.h = pen_y + atlas.height;
+    sdl_ptr<SDL_Surface> atlasSurf(SDL_CreateRGBSurfaceWithFormat(0, atlas.w, atlas.h, 32, SDL_PIXELFORMAT_RGBA8888));
+    if (!atlasSurf) failSDL("SDL_CreateRGBSurfaceWithFormat");
+    CHECK_SDL(SDL_FillRect(atlasSurf.get(), NULL, 0));
 
-    if (ren) SDL_DestroyRenderer(ren);
-    if (font) TTF_CloseFont(font);
-    if (win) SDL_DestroyWindow(win);
+    FOR(i, static_cast<int>(glyphSurfs.size())) {
+        SDL_Rect dst = atlas.glyphs[i].src;
+        CHECK_SDL(SDL_SetSurfaceBlendMode(glyphSurfs[i].get(), SDL_BLENDMODE_NONE));
+        CHECK_SDL(SDL_BlitSurface(glyphSurfs[i].get(), NULL, atlasSurf.get(), &dst));
+    }
 
-    IMG_Quit();
-    TTF_Quit();
-    SDL_Quit();
+    atlas.pixel_storage.resize(atlas.w * atlas.h);
+    CHECK_SDL(SDL_LockSurface(atlasSurf.get()));
+    FOR(y, atlas.h) {
+        Uint32 const * row = reinterpret_cast<Uint32 const *>(static_cast<Uint8 const *>(atlasSurf->pixels) + y * atlasSurf->pitch);
+        std::copy(row, row + atlas.w, &atlas.pixel_storage[y * atlas.w]);
+    }
+    SDL_UnlockSurface(atlasSurf.get());
+    atlas.pixels = atlas.pixel_storage.data();
 }
 
-// FPS tracking
-const int CIRCBUF_LEN = 64;
-Uint32 circbuf[CIRCBUF_LEN];
-int circbuf_i;
-
-void initFPSTracking()
+void UploadGlyphAtlas(GlyphAtlas & atlas, SDL_Renderer * ren)
 {
-    memset(circbuf, 0, sizeof(circbuf));
-    circbuf_i = 0;
+    atlas.tex.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, atlas.w, atlas.h));
+    if (!atlas.tex) failSDL("SDL_CreateTexture");
+    CHECK_SDL(SDL_UpdateTexture(atlas.tex.get(), NULL, atlas.pixels, atlas.w * sizeof(Uint32)));
+    CHECK_SDL(SDL_SetTextureBlendMode(atlas.tex.get(), SDL_BLENDMODE_BLEND));
 }
 
-void accumTime(Uint32 ms)
+int TextWidth(GlyphAtlas const & atlas, const char * s)
 {
-    circbuf[circbuf_i++] = ms;
-    if (circbuf_i >= CIRCBUF_LEN) circbuf_i = 0;
+    int w = 0;
+    for (const char * c = s; *c; ++c) w += atlas.glyph(*c)->advance;
+    return w;
 }
 
-double avgFrameTime_ms()
+void DrawText(SDL_Renderer * ren, GlyphAtlas const & atlas, const char * s, SDL_Color color, int x, int y, int * textW, int * textH, bool center = false)
 {
-    double ret = 0;
-    FOR(i, CIRCBUF_LEN) ret += circbuf[i];
-    return ret / CIRCBUF_LEN;
-}
-
-// main code
-#ifdef __EMSCRIPTEN__
-const int TILE_COLS = 128;
-const int TILE_ROWS = 96;
-
-const int WIN_WIDTH = 512;
-const int WIN_HEIGHT = 384;
-#else
-const int TILE_COLS = 320;//256;//128;
-const int TILE_ROWS = 240;//192;//96;
+    int tW, tH;
+    if (textW == NULL) textW = &tW;
+    if (textH == NULL) textH = &tH;
 
-const int WIN_WIDTH = 1600;
-const int WIN_HEIGHT = 1200;
-#endif
+    *textW = TextWidth(atlas, s);
+    *textH = atlas.height;
 
-const int FONT_HEIGHT = 16;
+    if (center) {
+        x -= *textW / 2;
+        y -= *textH / 2;
+    }
 
-const int MAP_HEIGHT = 16;
-const int MAP_WIDTH = 16;
+    CHECK_SDL(SDL_SetTextureColorMod(atlas.tex.get(), color.r, color.g, color.b));
+    for (const char * c = s; *c; ++c) {
+        Glyph const * g = atlas.glyph(*c);
+        SDL_Rect dst = { x, y, g->src.w, g->src.h };
+        if (SDL_RenderCopy(ren, atlas.tex.get(), &g->src, &dst) < 0) failSDL("SDL_RenderCopy");
+        x += g->advance;
+    }
+}
 
-char map_grid[MAP_HEIGHT][MAP_WIDTH+1] = {
-    "#########.......",
-    "#..............#",
-    "#.......########",
-    "#..............#",
-    "#......##......#",
-    "#......##......#",
-    "#..........f...#",
-    "###......f.....#",
-    "##.............#",
-    "#......####..###",
-    "#......#.......#",
-    "#......#.......#",
-    "#..............#",
-    "#....f.#########",
-    "#..............#",
-    "################",
+// A texture kept both as an SDL texture (for the SDL backend) and as
+// CPU-side RGBA8888 texels (for the software backend).
+//
+// The CPU texels are stored column-major, since walls and sprites are drawn
+// one vertical texture column at a time: drawing a column is then a
+// sequential read. Each texture also carries a box-filtered mip chain down to
+// 1x1, stored the same way.
+//
+// For sprites, each column also lists its runs of opaque texels, so the
+// software backend can skip the transparent parts without sampling them.
+//
+// Each level also has its texels as palette indices, in the same layout, for
+// the indexed software path (see Palette).
+//
+// The texel arrays are either the storage vectors or, when the textures come
+// from the asset pack, the pack itself.
+struct TexelRun
+{
+    Uint16 y1;
+    Uint16 y2; // opaque texels [y1, y2)
 };
 
-const double EPS = 1e-8;
-
-const double PLAYER_MOVE_SPEED = 2.0;
+struct MipLevel
+{
+    int w;
+    int h;
+    Uint32 const * columns; // texel (x, y) is columns[x*h + y]
+    TexelRun const * runs;  // column x's runs are runs[run_index[x], run_index[x+1])
+    int const * run_index;
+    Uint8 const * indices;  // palette index of texel (x, y) is indices[x*h + y]
+
+    Uint32 const * column(int x) const
+    {
+        return columns + x*h;
+    }
 
-double player_x;
-double player_y;
-double player_angle; // in interval [0,1)
+    Uint8 const * index_column(int x) const
+    {
+        return indices + x*h;
+    }
 
-double player_dx;
-double player_dy;
-double screen_tan_max;
+    TexelRun const * runs_begin(int x) const
+    {
+        return runs + run_index[x];
+    }
 
-struct Vector3D {
-    double x,y,z;
+    TexelRun const * runs_end(int x) const
+    {
+        return runs + run_index[x+1];
+    }
 };
 
-struct SceneRect {
-    double z,x,y,w,h;
-};
+struct Texture
+{
+    sdl_ptr<SDL_Texture> sdl;
+    int w;
+    int h;
+    std::vector<MipLevel> mips;
+    std::vector<Uint32> storage; // all mip levels, back to back
+    std::vector<TexelRun> run_storage;
+    std::vector<int> run_index_storage;
+    std::vector<Uint8> index_storage;
+    Uint32 const * rows; // row-major level 0 for the SDL texture; NULL if there's none
+    std::vector<Uint32> row_storage;
+
+    Texture() : w(0), h(0), rows(NULL) {}
+
+    Uint32 const * column(int x) const
+    {
+        return mips[0].column(x);
+    }
 
-struct ViewRect {
-    double x,y,w,h;
+    Uint32 texel(int x, int y) const
+    {
+        return column(x)[y];
+    }
 };
 
-Vector3D world_to_scene(Vector3D v_world)
+bool texel_opaque(Uint32 texel)
 {
-    Vector3D v_scene;
-    v_scene.z = player_dx * (v_world.x - player_x) + player_dy * (v_world.y - player_y);
-    v_scene.x = -player_dy * (v_world.x - player_x) + player_dx * (v_world.y - player_y);
-    v_scene.y = -v_world.z;
-    return v_scene;
+    return (texel & 0xff) >= 0x80;
 }
 
-ViewRect scene_to_view(SceneRect r_scene)
+// Average a 2x2 (or smaller, at odd edges) block of texels, weighting colour
+// by alpha so that transparent texels don't darken the result.
+Uint32 average_texels(Uint32 const * texels, int n)
 {
-    ViewRect r_view;
-    r_view.x = r_scene.x / r_scene.z;
-    r_view.y = r_scene.y / r_scene.z;
-    r_view.w = r_scene.w / r_scene.z;
-    r_view.h = r_scene.h / r_scene.z;
-    return r_view;
+    Uint32 r = 0, g = 0, b = 0, a = 0;
+    FOR(i, n) {
+        Uint32 t = texels[i];
+        Uint32 ta = t & 0xff;
+        r += (t >> 24) * ta;
+        g += ((t >> 16) & 0xff) * ta;
+        b += ((t >> 8) & 0xff) * ta;
+        a += ta;
+    }
+    if (a == 0) return 0;
+    return ((r / a) << 24) | ((g / a) << 16) | ((b / a) << 8) | (a / n);
 }
 
-SDL_Rect view_to_sdl(ViewRect r_view)
+// Build the column-major mip chain of `tex` from row-major texels.
+void BuildTextureStore(Texture & tex, Uint32 const * rows, int pitch_texels)
 {
-    double tile_per_view = (TILE_COLS-1) / (2.0 * screen_tan_max);
+    size_t total = 0;
+    for (int w = tex.w, h = tex.h; ; w = std::max(w/2, 1), h = std::max(h/2, 1)) {
+        total += w * h;
+        if (w == 1 && h == 1) break;
+    }
+    tex.storage.resize(total);
+    tex.mips.clear();
+
+    Uint32 * dst = &tex.storage[0];
+    MipLevel base = { tex.w, tex.h, dst, NULL, NULL, NULL };
+    FOR(x, tex.w) FOR(y, tex.h) dst[x*tex.h + y] = rows[y*pitch_texels + x];
+    tex.mips.push_back(base);
+    dst += tex.w * tex.h;
+
+    while (tex.mips.back().w > 1 || tex.mips.back().h > 1) {
+        MipLevel const & prev = tex.mips.back();
+        MipLevel level = { std::max(prev.w/2, 1), std::max(prev.h/2, 1), dst, NULL, NULL, NULL };
+        FOR(x, level.w) FOR(y, level.h) {
+            Uint32 block[4];
+            int n = 0;
+            FOR(dx, 2) FOR(dy, 2) {
+                int sx = 2*x + dx;
+                int sy = 2*y + dy;
+                if (sx < prev.w && sy < prev.h) block[n++] = prev.column(sx)[sy];
+            }
+            dst[x*level.h + y] = average_texels(block, n);
+        }
+        dst += level.w * level.h;
+        tex.mips.push_back(level);
+    }
 
-    SDL_Rect r_sdl;
-    r_sdl.x = static_cast<int>(round((r_view.x) * tile_per_view + TILE_COLS/2.0));
-    r_sdl.y = static_cast<int>(round((r_view.y) * tile_per_view + TILE_ROWS/2.0));
-    int x2 = static_cast<int>(round((r_view.x + r_view.w) * tile_per_view + TILE_COLS/2.0));
-    int y2 = static_cast<int>(round((r_view.y + r_view.h) * tile_per_view + TILE_ROWS/2.0));
-    r_sdl.w = x2 - r_sdl.x;
-    r_sdl.h = y2 - r_sdl.y;
-    return r_sdl;
+    // opaque runs, indexed per column across all levels; the pointers are set
+    // once the vectors have stopped growing
+    tex.run_storage.clear();
+    tex.run_index_storage.clear();
+    std::vector<size_t> level_index;
+    for (MipLevel const & level : tex.mips) {
+        level_index.push_back(tex.run_index_storage.size());
+        FOR(x, level.w) {
+            tex.run_index_storage.push_back(tex.run_storage.size());
+            Uint32 const * column = level.column(x);
+            int y = 0;
+            while (y < level.h) {
+                if (!texel_opaque(column[y])) { ++y; continue; }
+                TexelRun run;
+                run.y1 = y;
+                while (y < level.h && texel_opaque(column[y])) ++y;
+                run.y2 = y;
+                tex.run_storage.push_back(run);
+            }
+        }
+        tex.run_index_storage.push_back(tex.run_storage.size());
+    }
+    FOR(i, static_cast<int>(tex.mips.size())) {
+        tex.mips[i].runs = tex.run_storage.data();
+        tex.mips[i].run_index = &tex.run_index_storage[level_index[i]];
+    }
 }
 
-void wrap_angle(double & angle) {
-    double intpart;
-    double fracpart = modf(angle, &intpart);
-    if (fracpart < 0) fracpart += 1;
-
-    angle = fracpart;
-}
+// Decode a PNG into `tex`; UploadTexture() makes the SDL texture.
+void LoadTexture(Texture & tex, const char * path)
+{
+    sdl_ptr<SDL_Surface> loaded(IMG_Load(path));
+    if (!loaded) failIMG("IMG_Load");
 
-double deltaFrame_s;
+    sdl_ptr<SDL_Surface> surf(SDL_ConvertSurfaceFormat(loaded.get(), SDL_PIXELFORMAT_RGBA8888, 0));
+    if (!surf) failSDL("SDL_ConvertSurfaceFormat");
 
-void moveplayer(double amt, double angle)
-{
-    amt *= deltaFrame_s;
-    player_x += amt * cos(2*M_PI * angle);
-    player_y += amt * sin(2*M_PI * angle);
-}
+    tex.w = surf->w;
+    tex.h = surf->h;
 
-void moveplayer(double amt)
-{
-    moveplayer(amt, player_angle);
+    tex.row_storage.resize(tex.w * tex.h);
+    CHECK_SDL(SDL_LockSurface(surf.get()));
+    FOR(y, tex.h) {
+        Uint32 const * row = reinterpret_cast<Uint32 const *>(static_cast<Uint8 const *>(surf->pixels) + y * surf->pitch);
+        std::copy(row, row + tex.w, &tex.row_storage[y * tex.w]);
+    }
+    SDL_UnlockSurface(surf.get());
+    tex.rows = tex.row_storage.data();
+    BuildTextureStore(tex, tex.rows, tex.w);
 }
 
-void strafeplayer(double amt)
+void UploadTexture(Texture & tex, SDL_Renderer * ren)
 {
-    double angle = player_angle + 0.25;
-    wrap_angle(angle);
-    moveplayer(amt, angle);
+    if (!tex.rows) return;
+    tex.sdl.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, tex.w, tex.h));
+    if (!tex.sdl) failSDL("SDL_CreateTexture");
+    CHECK_SDL(SDL_UpdateTexture(tex.sdl.get(), NULL, tex.rows, tex.w * sizeof(Uint32)));
+    CHECK_SDL(SDL_SetTextureBlendMode(tex.sdl.get(), SDL_BLENDMODE_BLEND));
 }
 
-void rotateplayer(double amt)
+// Fill `tex` with a size x size grid of tiles x tiles stone tiles, each a
+// little lighter or darker than `base`, separated by `mortar` lines. Used for
+// the floor and ceiling, which only the software backend draws textured, so
+// there is no SDL texture.
+void GenerateTileTexture(Texture & tex, int size, int tiles, Uint32 base, Uint32 mortar)
 {
-    amt *= deltaFrame_s;
-    player_angle += amt;
-    wrap_angle(player_angle);
+    tex.w = size;
+    tex.h = size;
+    std::vector<Uint32> rows(size * size);
+    int tile_size = size / tiles;
+    FOR(y, size) FOR(x, size) {
+        int tx = x / tile_size;
+        int ty = y / tile_size;
+        Uint32 texel = mortar;
+        if (x % tile_size != 0 && y % tile_size != 0) {
+            // cheap per-tile hash for the brightness jitter
+            unsigned h = (tx * 73856093u) ^ (ty * 19349663u);
+            int shade = static_cast<int>(h % 25) - 12;
+            texel = 0xff;
+            FR(shift, 1, 4) {
+                int c = static_cast<int>((base >> (8*shift)) & 0xff) + shade;
+                texel |= Uint32(std::max(0, std::min(c, 255))) << (8*shift);
+            }
+        }
+        rows[y*size + x] = texel;
+    }
+    BuildTextureStore(tex, rows.data(), size);
 }
 
-struct Entity
+// Palette
+// The indexed software path draws 8-bit palette indices rather than RGBA8888
+// texels, a quarter of the memory traffic, and turns them into colours once
+// per frame as the frame is uploaded. The palette is a median cut of the
+// textures' opaque texels plus the flat colours the renderer fills with,
+// which are kept exact; index 0 is transparent. Distance shading goes through
+// a colormap: colormap[l][i] is the entry nearest colour i dimmed to light
+// level l, so shading a pixel is one lookup.
+const int PALETTE_SIZE = 256;
+const Uint8 INDEX_TRANSPARENT = 0;
+const int LIGHT_LEVELS = 32;
+const double LIGHT_FALLOFF = 24; // distance at which the light is dimmest
+const double MIN_LIGHT = 0.3;
+
+struct Palette
 {
-    SDL_Texture * sprite;
-    double x;
-    double y;
-
-    double height_scene;
-    double width_scene;
-    Vector3D scene_coords;
-
-    int sprite_w;
-    int sprite_h;
-    double depth;
+    Uint32 colors[PALETTE_SIZE]; // RGBA8888
+    Uint8 colormap[LIGHT_LEVELS][PALETTE_SIZE];
+};
+Palette palette_storage;
+Palette const * palette = &palette_storage; // or the copy in the asset pack
 
-    Entity(SDL_Texture & sprite_, double x_, double y_)
-        : sprite(&sprite_)
-        , x(x_)
-        , y(y_)
-    {
-        depth = 0;
-        height_scene = 0.8; // TODO
-        width_scene = 0.8;
+// Sky, flat floor, minimap cells and marker.
+const Uint32 flat_colors[] = { 0x87ceebff, 0x282828ff, 0x404040ff, 0xffffffff, 0x000000ff, 0x963fffff };
 
-        CHECK_SDL(SDL_QueryTexture(sprite, NULL, NULL, &sprite_w, &sprite_h));
-    }
+int light_level(double dist)
+{
+    return std::max(0, std::min(LIGHT_LEVELS-1, static_cast<int>(dist * (LIGHT_LEVELS-1) / LIGHT_FALLOFF)));
+}
 
-    Vector3D world_coords()
-    {
-        Vector3D ret;
-        ret.x = x;
-        ret.y = y;
-        ret.z = -0.5;
-        return ret;
+int color_distance(Uint32 a, Uint32 b)
+{
+    int d = 0;
+    FR(shift, 1, 4) {
+        int c = static_cast<int>((a >> (8*shift)) & 0xff) - static_cast<int>((b >> (8*shift)) & 0xff);
+        d += c*c;
     }
-};
-std::vector<Entity> entities;
+    return d;
+}
 
-bool quitRequested;
-void update()
+// Opaque palette entry nearest `color`.
+Uint8 nearest_index(Uint32 color)
 {
-    SDL_Event e;
-    while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            quitRequested = true;
-        }
-
-        if (e.type == SDL_KEYDOWN) {
-            if (e.key.keysym.sym == SDLK_ESCAPE) {
-                quitRequested = true;
-            }
+    int best = 1;
+    int best_d = INT_MAX;
+    FR(i, 1, PALETTE_SIZE) {
+        int d = color_distance(color, palette->colors[i]);
+        if (d < best_d) {
+            best_d = d;
+            best = i;
         }
     }
-
-    Uint8 const * state = SDL_GetKeyboardState(NULL);
-    if (state[SDL_SCANCODE_S] || state[SDL_SCANCODE_DOWN]) {
-        moveplayer(-PLAYER_MOVE_SPEED);
-    }
-    if (state[SDL_SCANCODE_W] || state[SDL_SCANCODE_UP]) {
-        moveplayer(PLAYER_MOVE_SPEED);
-    }
-    if (state[SDL_SCANCODE_LEFT]) {
-        rotateplayer(-1.0/2.0);
-    }
-    if (state[SDL_SCANCODE_RIGHT]) {
-        rotateplayer(1.0/2.0);
-    }
-    if (state[SDL_SCANCODE_A]) {
-        strafeplayer(-PLAYER_MOVE_SPEED);
-    }
-    if (state[SDL_SCANCODE_D]) {
-        strafeplayer(PLAYER_MOVE_SPEED);
-    }
+    return static_cast<Uint8>(best);
 }
 
-const double FOV = 0.25; // in interval [0,1)
+// Texels [begin, end) of the median cut, and its widest channel.
+struct ColorBox
+{
+    int begin, end;
+    int shift; // of the widest channel
+    int range;
+};
 
-void drawtilerect(int x, int y, int w, int h)
+ColorBox color_box(std::vector<Uint32> const & texels, int begin, int end)
 {
-    SDL_Rect rect;
-    rect.x = x;
-    rect.y = y;
-    rect.w = w;
-    rect.h = h;
-    CHECK_SDL(SDL_RenderFillRect(ren, &rect));
+    ColorBox box = { begin, end, 3, 0 };
+    FR(shift, 1, 4) {
+        int lo = 255, hi = 0;
+        FR(i, begin, end) {
+            int c = (texels[i] >> (8*shift)) & 0xff;
+            lo = std::min(lo, c);
+            hi = std::max(hi, c);
+        }
+        if (hi - lo > box.range) {
+            box.range = hi - lo;
+            box.shift = shift;
+        }
+    }
+    return box;
 }
 
-void drawtile(int x, int y)
+Uint32 dim_color(Uint32 color, double light)
 {
-    drawtilerect(x, y, 1, 1);
+    Uint32 dimmed = color & 0xff;
+    FR(shift, 1, 4) dimmed |= Uint32(((color >> (8*shift)) & 0xff) * light + 0.5) << (8*shift);
+    return dimmed;
 }
 
-#define ENABLE_SUBPIXEL_TEXTURE_MAPPING 0
-
-void map_texture_column(SDL_Texture * tex, int tex_x, int ren_x, double view_y1, double view_y2)
+// Build palette_storage and its colormap from the level 0 texels of `textures`.
+// The cut sees each texel at a few light levels, so the palette also has
+// the darker shades the colormap needs.
+void BuildPalette(std::vector<Texture const *> const & textures)
 {
-    double tile_per_view = (TILE_COLS-1) / (2.0 * screen_tan_max);
-    double ren_y1 = TILE_ROWS/2 + view_y1*tile_per_view;
-    double ren_y2 = TILE_ROWS/2 + view_y2*tile_per_view;
-
-    int texH;
-    if (SDL_QueryTexture(tex, NULL, NULL, NULL, &texH) < 0) failSDL("SDL_QueryTexture");
-
-    int ren_y1_int = static_cast<int>(round(ren_y1));
-    int ren_y2_int = static_cast<int>(round(ren_y2));
+    palette = &palette_storage;
+    Palette & pal = palette_storage;
+    std::fill(pal.colors, pal.colors + PALETTE_SIZE, 0x000000ff);
+    pal.colors[INDEX_TRANSPARENT] = 0;
+    int n = 1;
+    for (Uint32 color : flat_colors) pal.colors[n++] = color;
+
+    const int SHADES = 4;
+    std::vector<Uint32> texels;
+    for (Texture const * tex : textures) {
+        MipLevel const & base = tex->mips[0];
+        FOR(i, base.w * base.h) {
+            if (!texel_opaque(base.columns[i])) continue;
+            FOR(k, SHADES) texels.push_back(dim_color(base.columns[i] | 0xff, 1 - (1 - MIN_LIGHT) * k / (SHADES-1)));
+        }
+    }
 
-    if (ENABLE_SUBPIXEL_TEXTURE_MAPPING) {
-        if (ren_y1_int < 0) ren_y1_int = 0;
-        if (ren_y2_int >= TILE_ROWS) ren_y2_int = TILE_ROWS;
+    // split the box with the widest channel range at that channel's median
+    // until there's a box per free entry, or every box is one colour
+    std::vector<ColorBox> boxes;
+    if (!texels.empty()) boxes.push_back(color_box(texels, 0, texels.size()));
+    while (n + static_cast<int>(boxes.size()) < PALETTE_SIZE) {
+        int widest = 0;
+        FOR(b, static_cast<int>(boxes.size())) {
+            if (boxes[b].range > boxes[widest].range) widest = b;
+        }
+        if (boxes.empty() || boxes[widest].range == 0) break;
+        ColorBox box = boxes[widest];
+        int mid = (box.begin + box.end) / 2;
+        int shift = box.shift;
+        std::nth_element(texels.begin() + box.begin, texels.begin() + mid, texels.begin() + box.end, [shift](Uint32 a, Uint32 b) {
+            return ((a >> (8*shift)) & 0xff) < ((b >> (8*shift)) & 0xff);
+        });
+        boxes[widest] = color_box(texels, box.begin, mid);
+        boxes.push_back(color_box(texels, mid, box.end));
+    }
+    for (ColorBox const & box : boxes) {
+        Uint32 sum[4] = { 0, 0, 0, 0 };
+        FR(i, box.begin, box.end) FR(shift, 1, 4) sum[shift] += (texels[i] >> (8*shift)) & 0xff;
+        Uint32 color = 0xff;
+        FR(shift, 1, 4) color |= (sum[shift] / (box.end - box.begin)) << (8*shift);
+        pal.colors[n++] = color;
+    }
 
-        FR(ren_y, ren_y1_int, ren_y2_int) {
-            double tex_y_norm = (ren_y + 0.5 - ren_y1) / (ren_y2 - ren_y1);
-            int tex_y = static_cast<int>(tex_y_norm * texH);
-            if (tex_y >= texH) tex_y = texH;
+    FOR(l, LIGHT_LEVELS) {
+        double light = 1 - (1 - MIN_LIGHT) * l / (LIGHT_LEVELS-1);
+        pal.colormap[l][INDEX_TRANSPARENT] = INDEX_TRANSPARENT;
+        FR(i, 1, PALETTE_SIZE) pal.colormap[l][i] = nearest_index(dim_color(pal.colors[i], light));
+    }
+}
 
-            SDL_Rect srcrect = { tex_x, tex_y, 1, 1 };
-            SDL_Rect dstrect = { ren_x, ren_y, 1, 1 };
-            CHECK_SDL(SDL_RenderCopy(ren, tex, &srcrect, &dstrect));
+// Fill in the palette indices of every mip level of `tex`.
+void BuildTextureIndices(Texture & tex)
+{
+    size_t total = 0;
+    for (MipLevel const & level : tex.mips) total += level.w * level.h;
+    tex.index_storage.resize(total);
+
+    std::unordered_map<Uint32, Uint8> nearest;
+    Uint8 * dst = tex.index_storage.data();
+    for (MipLevel & level : tex.mips) {
+        FOR(i, level.w * level.h) {
+            Uint32 texel = level.columns[i];
+            if (!texel_opaque(texel)) {
+                dst[i] = INDEX_TRANSPARENT;
+                continue;
+            }
+            std::unordered_map<Uint32, Uint8>::const_iterator it = nearest.find(texel);
+            if (it == nearest.end()) it = nearest.insert(std::make_pair(texel, nearest_index(texel))).first;
+            dst[i] = it->second;
         }
-    } else {
-        SDL_Rect srcrect = { tex_x, 0, 1, texH };
-        SDL_Rect dstrect = { ren_x, ren_y1_int, 1, ren_y2_int-ren_y1_int };
-        CHECK_SDL(SDL_RenderCopy(ren, tex, &srcrect, &dstrect));
+        level.indices = dst;
+        dst += level.w * level.h;
     }
 }
 
-double column_dist[TILE_COLS];
+// Worker pool
+// The threads are started once and park between jobs. parallel_for() splits
+// [0, n) into one contiguous band per thread, runs band 0 on the calling
+// thread, and returns when every band is done, so it doubles as a barrier.
 
-void render()
+// Band of the pool thread running this code; 0 is the main thread.
+thread_local int worker_index = 0;
+struct ThreadPool
 {
-    //// useful global values
-    player_dx = cos(2*M_PI * player_angle);
-    player_dy = sin(2*M_PI * player_angle);
-
-    double screen_angle_max = FOV/2;
-    screen_tan_max = tan(2*M_PI * screen_angle_max);
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::function<void(int, int)> const * job;
+    int job_n;
+    unsigned generation;
+    int pending;
+    bool stopping;
+
+    ThreadPool() : job(NULL), job_n(0), generation(0), pending(0), stopping(false) {}
+
+    int size() const
+    {
+        return static_cast<int>(workers.size()) + 1;
+    }
 
-    //// floor & ceiling
-    CHECK_SDL(SDL_SetRenderTarget(ren, pixel_screen.get()));
+    void start(int num_threads)
+    {
+        stopping = false;
+        FR(i, 1, num_threads) {
+            workers.push_back(std::thread(&ThreadPool::worker_main, this, i));
+        }
+    }
 
-    CHECK_SDL(SDL_SetRenderDrawColor(ren, 40, 40, 40, 255));
-    CHECK_SDL(SDL_RenderClear(ren));
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (auto & t : workers) {
+            if (t.get_id() == std::this_thread::get_id()) t.detach();
+            else t.join();
+        }
+        workers.clear();
+    }
 
-    CHECK_SDL(SDL_SetRenderDrawColor(ren, 135, 206, 235, 255));
-    drawtilerect(0, 0, TILE_COLS, TILE_ROWS/2);
+    void run_band(std::function<void(int, int)> const & fn, int n, int band)
+    {
+        int bands = size();
+        fn(static_cast<int>(static_cast<long long>(n) * band / bands),
+           static_cast<int>(static_cast<long long>(n) * (band+1) / bands));
+    }
 
-    //// ray-casting
-    double straight_x = 0;
-    double straight_y = 0;
-    double straight_dist = 0;
-
-    FOR(screen_col, TILE_COLS) {
-        double col_tan = -screen_tan_max + 2*screen_tan_max * screen_col / (TILE_COLS-1);
-        double col_angle_offset = atan(col_tan) / (2*M_PI);
-        double col_angle = player_angle + col_angle_offset;
-        wrap_angle(col_angle);
-
-        double proj_xs[4] = {};
-        double proj_ys[4] = {};
-        double proj_dists[4] = {};
-        int proj_colors[4] = {};
-        int proj_tex_offsets[4] = {};
-
-        if (col_angle < 0.25 || 0.75 < col_angle) {
-            // intersect ray with west-facing walls
-            double slope = tan(2*M_PI * col_angle);
-
-            int x1 = static_cast<int>(ceil(player_x));
-            x1 = std::max(x1, 0);
-
-            FR(x, x1, MAP_WIDTH) {
-                double y = (x-player_x) * slope + player_y;
-                int yf = static_cast<int>(y);
-
-                if (0 <= yf && yf < MAP_HEIGHT && map_grid[yf][x] == '#') {
-                    proj_xs[0] = x;
-                    proj_ys[0] = y;
-                    proj_dists[0] = player_dx * (x-player_x) + player_dy * (y-player_y);
-                    proj_colors[0] = 1;
-                    proj_tex_offsets[0] = static_cast<int>(16*(y-yf));
-                    break;
-                }
-            }
+    void parallel_for(int n, std::function<void(int, int)> const & fn)
+    {
+        if (workers.empty()) {
+            fn(0, n);
+            return;
         }
 
-        if (0.0 < col_angle && col_angle < 0.5) {
-            // intersect ray with north-facing walls
-            double slope = tan(2*M_PI * (0.25-col_angle));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            job_n = n;
+            pending = static_cast<int>(workers.size());
+            ++generation;
+        }
+        work_cv.notify_all();
 
-            int y1 = static_cast<int>(ceil(player_y));
-            y1 = std::max(y1, 0);
+        run_band(fn, n, 0);
 
-            FR(y, y1, MAP_HEIGHT) {
-                double x = (y-player_y) * slope + player_x;
-                int xf = static_cast<int>(x);
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return pending == 0; });
+    }
 
-                if (0 <= xf && xf < MAP_WIDTH && map_grid[y][xf] == '#') {
-                    proj_xs[1] = x;
-                    proj_ys[1] = y;
-                    proj_dists[1] = player_dx * (x-player_x) + player_dy * (y-player_y);
-                    proj_colors[1] = 2;
-                    proj_tex_offsets[1] = static_cast<int>(16*(x-xf));
-                    break;
-                }
+    void worker_main(int band)
+    {
+        worker_index = band;
+        unsigned seen = 0;
+        for (;;) {
+            std::function<void(int, int)> const * fn;
+            int n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [this, seen] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                fn = job;
+                n = job_n;
             }
-        }
-
-        if (0.25 < col_angle && col_angle < 0.75) {
-            // intersect ray with east-facing walls
-            double slope = tan(2*M_PI * col_angle);
 
-            int x1 = static_cast<int>(floor(player_x));
-            x1 = std::min(x1, MAP_WIDTH-1);
+            run_band(*fn, n, band);
 
-            for (int x = x1; x >= 1; --x) {
-                double y = (x-player_x) * slope + player_y;
-                int yf = static_cast<int>(y);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) done_cv.notify_one();
+        }
+    }
+};
+ThreadPool render_pool;
+
+int default_thread_count()
+{
+#if HAVE_THREADS
+    int n = static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(1, std::min(n, 16));
+#else
+    return 1;
+#endif
+}
+
+// SDL data, cleanup, etc.
+SDL_Window * win = NULL;
+SDL_Renderer * ren = NULL;
+
+GlyphAtlas glyph_atlas;
+
+sdl_ptr<SDL_Texture> pixel_screen;
+sdl_ptr<SDL_Texture> framebuffer_tex;
+sdl_ptr<SDL_Texture> minimap_tex;
+sdl_ptr<SDL_Texture> hud_layer;
+
+Texture red_brick;
+Texture green_brick;
+Texture red_panel;
+Texture green_panel;
+Texture red_2panel;
+Texture green_2panel;
+
+Texture frog_sprite;
+
+Texture floor_texture;
+Texture ceiling_texture;
+
+// Every texture, by its name in the asset pack.
+struct TextureAsset
+{
+    Texture * tex;
+    const char * name;
+    const char * path; // PNG it's decoded from, or NULL if it's generated
+};
+
+TextureAsset const texture_assets[] = {
+    { &red_brick, "red_brick", "data/red_brick.png" },
+    { &green_brick, "green_brick", "data/green_brick.png" },
+    { &red_panel, "red_panel", "data/red_panel.png" },
+    { &green_panel, "green_panel", "data/green_panel.png" },
+    { &red_2panel, "red_2panel", "data/red_2panel.png" },
+    { &green_2panel, "green_2panel", "data/green_2panel.png" },
+    { &frog_sprite, "frog", "data/frog.png" },
+    { &floor_texture, "floor", NULL },
+    { &ceiling_texture, "ceiling", NULL },
+};
+const int NUM_TEXTURE_ASSETS = sizeof(texture_assets) / sizeof(texture_assets[0]);
+
+void stop_render_thread(); // defined with the render thread, further down
+
+void cleanup()
+{
+    stop_render_thread();
+    render_pool.stop();
+
+    FOR(i, NUM_TEXTURE_ASSETS) texture_assets[i].tex->sdl.reset();
+
+    framebuffer_tex.reset();
+    minimap_tex.reset();
+    hud_layer.reset();
+    pixel_screen.reset();
+
+    glyph_atlas.tex.reset();
+
+    if (ren) SDL_DestroyRenderer(ren);
+    if (win) SDL_DestroyWindow(win);
+
+    IMG_Quit();
+    TTF_Quit();
+    SDL_Quit();
+}
+
+// Fixed-size ring that any thread can push to without locking. Readers only
+// look at it between frames, after parallel_for() has synchronized with the
+// workers. N must be a power of two.
+template <typename T, unsigned N>
+struct Ring
+{
+    T items[N];
+    std::atomic<unsigned> head;
+
+    Ring() : head(0) {}
+
+    void push(T const & item)
+    {
+        unsigned i = head.fetch_add(1, std::memory_order_relaxed);
+        items[i & (N-1)] = item;
+    }
+
+    // Number of items ever pushed; the last min(count(), N) are still held.
+    unsigned count() const
+    {
+        return head.load(std::memory_order_relaxed);
+    }
+
+    unsigned held() const
+    {
+        return std::min(count(), N);
+    }
+
+    // i-th most recent item
+    T const & back(unsigned i) const
+    {
+        return items[(count() - 1 - i) & (N-1)];
+    }
+
+    T const & at(unsigned i) const
+    {
+        return items[i & (N-1)];
+    }
+};
+
+// Heap allocation counter
+// Counts every operator new, so a frame's allocations can be checked: the
+// benchmark fails if the frames after its warmup allocate at all. SDL's own
+// mallocs aren't seen. Building with -DCOUNT_ALLOCATIONS=0 leaves operator
+// new alone.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 1
+#endif
+
+std::atomic<unsigned long> heap_allocations(0);
+unsigned long frame_allocations; // in main_loop()'s last whole frame, shown on the HUD
+unsigned long frame_allocations_mark;
+
+#if COUNT_ALLOCATIONS
+// kept out of line, or GCC sees the malloc and free behind them and warns
+// that they don't match new and delete
+#if defined(__GNUC__)
+#define ALLOC_NOINLINE __attribute__((noinline))
+#else
+#define ALLOC_NOINLINE
+#endif
+
+ALLOC_NOINLINE void * operator new(size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void * p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+ALLOC_NOINLINE void operator delete(void * p) noexcept
+{
+    free(p);
+}
+#endif
+
+// Frame arena
+// Bump allocator for data that only lives for one frame, like the entities a
+// view is about to sort or the column spans a sprite shows in; reset() frees
+// it all at once. What doesn't fit in the block still gets memory, from the
+// heap, and the next reset() grows the block to fit it, so after the first
+// frames a frame's scratch comes from the heap no more. Only for trivially
+// destructible types, and not thread-safe: each Renderer has its own.
+struct FrameArena
+{
+    std::vector<char> block;
+    std::vector<std::unique_ptr<char[]> > spilled; // what didn't fit
+    size_t used;   // of block
+    size_t wanted; // since the last reset, spilled or not
+
+    FrameArena() : used(0), wanted(0) {}
+
+    template <typename T>
+    T * alloc(size_t n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "the arena never runs destructors");
+        const size_t ALIGN = 16;
+        size_t bytes = (n * sizeof(T) + ALIGN-1) & ~(ALIGN-1);
+        wanted += bytes;
+        if (used + bytes <= block.size()) {
+            T * p = reinterpret_cast<T *>(block.data() + used);
+            used += bytes;
+            return p;
+        }
+        spilled.push_back(std::unique_ptr<char[]>(new char[bytes]));
+        return reinterpret_cast<T *>(spilled.back().get());
+    }
+
+    void reset()
+    {
+        if (!spilled.empty()) {
+            spilled.clear();
+            std::vector<char>(wanted + wanted/2).swap(block);
+        }
+        used = 0;
+        wanted = 0;
+    }
+};
+
+// FPS tracking
+const unsigned FRAME_TIMES_LEN = 128;
+const unsigned FRAME_AVG_LEN = 64;
+Ring<float, FRAME_TIMES_LEN> frame_times; // in ms
+
+double avgFrameTime_ms()
+{
+    unsigned n = std::min(frame_times.held(), FRAME_AVG_LEN);
+    if (n == 0) return 0;
+    double ret = 0;
+    FOR(i, int(n)) ret += frame_times.back(i);
+    return ret / n;
+}
+
+// Input-to-present latency: from reading the input a frame shows to that
+// frame's SDL_RenderPresent returning.
+Ring<float, FRAME_TIMES_LEN> latency_times; // in ms
+
+double avgLatency_ms()
+{
+    unsigned n = std::min(latency_times.held(), FRAME_AVG_LEN);
+    if (n == 0) return 0;
+    double ret = 0;
+    FOR(i, int(n)) ret += latency_times.back(i);
+    return ret / n;
+}
+
+// Per-phase timing of the last frame, from the high-resolution counter.
+enum Phase { PHASE_FLOOR, PHASE_RAYCAST, PHASE_WALLS, PHASE_SPRITES, PHASE_MINIMAP, PHASE_HUD, PHASE_PRESENT, PHASE_COUNT };
+const char * const phase_names[PHASE_COUNT] = { "floor", "raycast", "walls", "sprites", "minimap", "hud", "present" };
+
+double phase_ms[PHASE_COUNT];
+thread_local Uint64 phase_start; // the world and present phases may run on different threads
+
+double counter_to_ms(Uint64 ticks)
+{
+    return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Start timing phases [first, last) on this thread, into `ms`.
+void begin_phases(Phase first, Phase last, double * ms = phase_ms)
+{
+    std::fill(ms + first, ms + last, 0.0);
+    phase_start = SDL_GetPerformanceCounter();
+}
+
+void end_phase(Phase phase, double * ms = phase_ms)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    ms[phase] += counter_to_ms(now - phase_start);
+    phase_start = now;
+}
+
+// Profiling zones
+// PROFILE_ZONE(zone) times the rest of the enclosing scope, on any thread,
+// into zone_events. Building with -DENABLE_PROFILER=0 compiles them out.
+#ifndef ENABLE_PROFILER
+#define ENABLE_PROFILER 1
+#endif
+
+enum Zone { ZONE_UPDATE, ZONE_RENDER, ZONE_CAST_COLUMNS, ZONE_DRAW_WALLS, ZONE_TEXTURE_COLUMN, ZONE_PRESENT, ZONE_COUNT };
+const char * const zone_names[ZONE_COUNT] = { "update", "render", "cast_columns", "draw_walls", "texture_column", "present" };
+
+struct ZoneEvent
+{
+    Uint64 start, end;
+    Uint16 zone, thread;
+};
+
+const unsigned ZONE_EVENTS_LEN = 1 << 15;
+Ring<ZoneEvent, ZONE_EVENTS_LEN> zone_events;
+unsigned frame_events_begin;
+
+double zone_ms[ZONE_COUNT]; // last frame, summed over threads
+
+#if ENABLE_PROFILER
+struct ProfileZone
+{
+    Zone zone;
+    Uint64 start;
+
+    explicit ProfileZone(Zone zone) : zone(zone), start(SDL_GetPerformanceCounter()) {}
+
+    ~ProfileZone()
+    {
+        ZoneEvent e = { start, SDL_GetPerformanceCounter(), Uint16(zone), Uint16(worker_index) };
+        zone_events.push(e);
+    }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(zone) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(zone)
+#else
+#define PROFILE_ZONE(zone) do {} while (0)
+#endif
+
+// PROFILE_COLUMN_ZONE(zone) is for the per-column drawing code, where two
+// counter reads and a push onto the shared ring per column would skew what
+// they time; it's only recorded when built with -DPROFILE_COLUMNS=1.
+#ifndef PROFILE_COLUMNS
+#define PROFILE_COLUMNS 0
+#endif
+
+#if ENABLE_PROFILER && PROFILE_COLUMNS
+#define PROFILE_COLUMN_ZONE(zone) PROFILE_ZONE(zone)
+#else
+#define PROFILE_COLUMN_ZONE(zone) do {} while (0)
+#endif
+
+// Chrome trace capture (load the file in about:tracing or Perfetto).
+const int TRACE_FRAMES = 120;
+std::string trace_path = "trace.json";
+int trace_frames_left;
+std::vector<ZoneEvent> trace_events;
+
+void start_trace()
+{
+    if (trace_frames_left > 0) return;
+    trace_events.clear();
+    trace_frames_left = TRACE_FRAMES;
+}
+
+void write_trace()
+{
+    FILE * f = fopen(trace_path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Couldn't write %s\n", trace_path.c_str());
+        return;
+    }
+    Uint64 origin = trace_events.empty() ? 0 : trace_events[0].start;
+    FOR(i, int(trace_events.size())) origin = std::min(origin, trace_events[i].start);
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    FOR(i, int(trace_events.size())) {
+        ZoneEvent const & e = trace_events[i];
+        fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+            zone_names[e.zone], e.thread, counter_to_ms(e.start - origin) * 1000, counter_to_ms(e.end - e.start) * 1000);
+    }
+    // the render thread, if any, comes after the pool's threads
+    int num_threads = render_pool.size();
+    FOR(i, int(trace_events.size())) num_threads = std::max(num_threads, trace_events[i].thread + 1);
+    FOR(t, num_threads) {
+        fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}%s\n",
+            t, t == 0 ? "main" : t < render_pool.size() ? "worker" : "render", t, t + 1 < num_threads ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    printf("Wrote %d trace events to %s\n", int(trace_events.size()), trace_path.c_str());
+
+#ifdef __EMSCRIPTEN__
+    // hand the file to the browser as a download
+    EM_ASM({
+        var path = UTF8ToString($0);
+        var blob = new Blob([FS.readFile(path)], { type: 'application/json' });
+        var a = document.createElement('a');
+        a.href = URL.createObjectURL(blob);
+        a.download = path.split('/').pop();
+        a.click();
+    }, trace_path.c_str());
+#endif
+}
+
+// Called once per frame: records the frame time, totals the frame's zones,
+// and feeds the trace capture if one is running.
+void end_profile_frame(double frame_ms)
+{
+    frame_times.push(float(frame_ms));
+
+    unsigned end = zone_events.count();
+    unsigned begin = frame_events_begin;
+    if (end - begin > ZONE_EVENTS_LEN) begin = end - ZONE_EVENTS_LEN; // overran the ring
+    frame_events_begin = end;
+
+    std::fill(zone_ms, zone_ms + ZONE_COUNT, 0.0);
+    for (unsigned i = begin; i != end; ++i) {
+        ZoneEvent const & e = zone_events.at(i);
+        zone_ms[e.zone] += counter_to_ms(e.end - e.start);
+        if (trace_frames_left > 0) trace_events.push_back(e);
+    }
+
+    if (trace_frames_left > 0 && --trace_frames_left == 0) write_trace();
+}
+
+// Numeric type of the ray-caster
+// RAYCAST_REAL picks the type used for scene/view coordinates and the ray
+// loop: double, float, or 16.16 fixed point. Emscripten builds default to
+// float, which is cheaper in WASM and doubles the SIMD lane count.
+#define REAL_DOUBLE 0
+#define REAL_FLOAT 1
+#define REAL_FIXED 2
+
+#ifndef RAYCAST_REAL
+#ifdef __EMSCRIPTEN__
+#define RAYCAST_REAL REAL_FLOAT
+#else
+#define RAYCAST_REAL REAL_DOUBLE
+#endif
+#endif
+
+// 16.16 fixed point. Every operation saturates instead of wrapping, so
+// degenerate rays (near-zero distances, huge slopes) clamp rather than
+// overflow.
+struct Fixed
+{
+    static const int FRAC_BITS = 16;
+    static const Sint32 ONE = 1 << FRAC_BITS;
+    static const Sint32 MAX_RAW = 0x7fffffff;
+    static const Sint32 MIN_RAW = -0x7fffffff;
+
+    Sint32 v;
+
+    static Fixed raw(Sint64 r)
+    {
+        Fixed f;
+        f.v = static_cast<Sint32>(std::max<Sint64>(MIN_RAW, std::min<Sint64>(r, MAX_RAW)));
+        return f;
+    }
+
+    Fixed() : v(0) {}
+    Fixed(int i) : v(raw(static_cast<Sint64>(i) * ONE).v) {}
+    Fixed(double d)
+    {
+        double r = d * ONE;
+        if (r != r) v = 0;
+        else if (r >= MAX_RAW) v = MAX_RAW;
+        else if (r <= MIN_RAW) v = MIN_RAW;
+        else v = static_cast<Sint32>(r);
+    }
+
+    explicit operator double() const
+    {
+        return static_cast<double>(v) / ONE;
+    }
+
+    static Fixed max()
+    {
+        return raw(MAX_RAW);
+    }
+
+    Fixed & operator+=(Fixed b) { v = raw(static_cast<Sint64>(v) + b.v).v; return *this; }
+    Fixed & operator-=(Fixed b) { v = raw(static_cast<Sint64>(v) - b.v).v; return *this; }
+};
+
+inline Fixed operator-(Fixed a) { return Fixed::raw(-static_cast<Sint64>(a.v)); }
+inline Fixed operator+(Fixed a, Fixed b) { return a += b; }
+inline Fixed operator-(Fixed a, Fixed b) { return a -= b; }
+inline Fixed operator*(Fixed a, Fixed b) { return Fixed::raw((static_cast<Sint64>(a.v) * b.v) >> Fixed::FRAC_BITS); }
+inline Fixed operator/(Fixed a, Fixed b)
+{
+    if (b.v == 0) return Fixed::raw(a.v < 0 ? Fixed::MIN_RAW : Fixed::MAX_RAW);
+    return Fixed::raw((static_cast<Sint64>(a.v) << Fixed::FRAC_BITS) / b.v);
+}
+inline bool operator<(Fixed a, Fixed b) { return a.v < b.v; }
+inline bool operator>(Fixed a, Fixed b) { return a.v > b.v; }
+inline bool operator<=(Fixed a, Fixed b) { return a.v <= b.v; }
+inline bool operator>=(Fixed a, Fixed b) { return a.v >= b.v; }
+inline bool operator==(Fixed a, Fixed b) { return a.v == b.v; }
+inline bool operator!=(Fixed a, Fixed b) { return a.v != b.v; }
+
+#if RAYCAST_REAL == REAL_FIXED
+typedef Fixed real;
+#elif RAYCAST_REAL == REAL_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+inline double to_double(real x)
+{
+    return static_cast<double>(x);
+}
+
+// Conversions to int saturate: a plain static_cast of an out-of-range value
+// is undefined behaviour, and traps in optimized WASM builds.
+inline int saturate_int(double x)
+{
+    if (x != x) return 0;
+    if (x <= INT_MIN) return INT_MIN;
+    if (x >= INT_MAX) return INT_MAX;
+    return static_cast<int>(x);
+}
+
+inline int floor_to_int(double x)
+{
+    return saturate_int(std::floor(x));
+}
+
+inline int round_to_int(double x)
+{
+    return saturate_int(std::round(x));
+}
+
+inline int floor_to_int(Fixed x)
+{
+    return x.v >> Fixed::FRAC_BITS;
+}
+
+inline int round_to_int(Fixed x)
+{
+    return static_cast<int>((static_cast<Sint64>(x.v) + Fixed::ONE/2) >> Fixed::FRAC_BITS);
+}
+
+inline real real_abs(real x)
+{
+    return x < real(0) ? -x : x;
+}
+
+inline real real_inf()
+{
+#if RAYCAST_REAL == REAL_FIXED
+    return Fixed::max();
+#else
+    return std::numeric_limits<real>::infinity();
+#endif
+}
+
+// main code
+// TILE_COLS x TILE_ROWS is the largest internal resolution, which sizes the
+// per-column arrays and framebuffers; tile_cols x tile_rows is the one
+// frames are drawn at, picked at run time (see Dynamic resolution).
+#ifdef __EMSCRIPTEN__
+const int TILE_COLS = 256;
+const int TILE_ROWS = 192;
+const int START_COLS = 128;
+
+const int WIN_WIDTH = 512;
+const int WIN_HEIGHT = 384;
+#else
+const int TILE_COLS = 320;//256;//128;
+const int TILE_ROWS = 240;//192;//96;
+const int START_COLS = TILE_COLS;
+
+const int WIN_WIDTH = 1600;
+const int WIN_HEIGHT = 1200;
+#endif
+
+int tile_cols = START_COLS;
+int tile_rows = START_COLS * TILE_ROWS / TILE_COLS;
+
+const int FONT_HEIGHT = 16;
+
+// Built-in level, in the text level format: '#' is a wall, '2'-'9' and
+// 'A'-'F' are walls of other materials, 'd' is a door, 's' is a pushwall
+// (it looks like '#'), 'f' is a frog and 'p' is the player.
+const int MAP_HEIGHT = 16;
+const int MAP_WIDTH = 16;
+
+char map_grid[MAP_HEIGHT][MAP_WIDTH+1] = {
+    "#########.......",
+    "#..............#",
+    "#.......####s###",
+    "#..............#",
+    "#......##......#",
+    "#......##......#",
+    "#..........f...#",
+    "###......f.....#",
+    "##.............#",
+    "#......####..###",
+    "#......#.......#",
+    "#......#.......#",
+    "#......d.......#",
+    "#....f.#########",
+    "#p.............#",
+    "################",
+};
+
+const int MINIMAP_SIZE = 16;
+
+// Levels
+// A level is a grid of 4-bit materials (0 is empty) split into square
+// chunks of CHUNK_SIZE cells, packed two cells per byte. The binary level
+// file is laid out so it can be used in place:
+//
+//   LevelHeader, LevelSpawn[num_spawns], then chunks_x*chunks_y chunks of
+//   CHUNK_BYTES each, row-major by chunk, cells row-major within a chunk,
+//   the even cell of each pair in the low nibble. Little-endian.
+//
+// Only the chunks within STREAM_RADIUS chunks of the player are resident,
+// copied into a fixed pool of slots; natively the file is memory-mapped and
+// the pages of each chunk are released once it's copied, so memory stays
+// bounded however big the level is. Cells of chunks that aren't resident read
+// as CELL_UNLOADED, which ends a ray like the edge of the map does.
+//
+// Alongside the materials, each resident cell keeps its Chebyshev distance to
+// the nearest cell a ray has to stop at (solid, outside the map, or not
+// resident), capped at DIST_MAX: every cell within dist-1 of it is empty, so
+// rays can jump that far at once. Edits update it locally (set_cell()). A
+// door or pushwall's cell holds DIST_MOVER instead of 0, so the ray-casters
+// only look movers up in the cells that have one.
+const int CHUNK_BITS = 6;
+const int CHUNK_SIZE = 1 << CHUNK_BITS;
+const int CHUNK_BYTES = CHUNK_SIZE * CHUNK_SIZE / 2;
+const int STREAM_RADIUS = 2;
+const int STREAM_SLOTS = (2*STREAM_RADIUS + 1) * (2*STREAM_RADIUS + 1);
+const int CHUNK_CELLS = CHUNK_SIZE * CHUNK_SIZE;
+const int DIST_MAX = 16;
+const int DIST_MOVER = -1;
+// Levels are kept to this many chunks (32768 x 32768 cells), so the per-chunk
+// tables stay a few megabytes and chunk offsets fit a 32-bit long.
+const Uint64 MAX_LEVEL_CHUNKS = 1 << 18;
+
+const int CELL_EMPTY = 0;
+const int CELL_UNLOADED = 16;
+
+const char LEVEL_MAGIC[4] = { 'R', 'R', 'L', 'V' };
+const Uint32 LEVEL_VERSION = 1;
+
+struct LevelHeader
+{
+    char magic[4];
+    Uint32 version;
+    Uint32 width, height; // in cells
+    Uint32 chunk_bits;
+    Uint32 num_spawns;
+    float player_x, player_y, player_angle;
+};
+
+// A door slides open along x or y, into the walls either side of it.
+enum SpawnKind { SPAWN_FROG = 1, SPAWN_DOOR_X = 2, SPAWN_DOOR_Y = 3, SPAWN_PUSHWALL = 4 };
+
+struct LevelSpawn
+{
+    float x, y;
+    Uint32 kind;
+};
+
+struct Level
+{
+    int width, height;
+    int chunks_x, chunks_y;
+    LevelHeader header;
+    std::vector<LevelSpawn> spawns;
+
+    // where chunk data comes from: a mapping or in-memory image, or a file
+    Uint8 const * image;
+    size_t image_size; // or the file's size
+    std::vector<Uint8> owned_image;
+    bool mapped;
+    FILE * file;
+    long chunks_offset;
+
+    std::vector<Uint8 *> resident; // per chunk, NULL when not loaded
+    std::vector<Sint8 *> resident_dist;
+    std::vector<int> resident_slot;
+    std::vector<int> resident_list;
+    std::vector<Uint8> slots;
+    std::vector<Sint8> dist_slots;
+    std::vector<int> free_slots;
+    int stream_cx, stream_cy; // chunk the resident set is centred on
+    int win_x1, win_y1, win_x2, win_y2; // resident cells, as [x1, x2) x [y1, y2)
+    unsigned revision; // bumped whenever the resident cells change, or a door or pushwall moves
+    unsigned resident_revision; // bumped whenever the resident set changes
+
+    // cells edited since the minimap last looked, for it to patch itself;
+    // past MAX_CHANGED_CELLS, only that there were too many is kept
+    std::vector<std::pair<int, int> > changed_cells;
+    bool changed_cells_lost;
+
+    // cell edits by chunk, reapplied whenever the chunk is loaded
+    std::unordered_map<int, std::unordered_map<int, Uint8> > edits;
+
+    std::vector<Uint8> dist_scratch;
+
+    Level() : width(0), height(0), chunks_x(0), chunks_y(0), header(), image(NULL), image_size(0), mapped(false), file(NULL), chunks_offset(0),
+        stream_cx(-1), stream_cy(-1), win_x1(0), win_y1(0), win_x2(0), win_y2(0), revision(0), resident_revision(0), changed_cells_lost(false) {}
+};
+Level level;
+
+inline int chunk_index(int x, int y)
+{
+    return (y >> CHUNK_BITS) * level.chunks_x + (x >> CHUNK_BITS);
+}
+
+inline int cell_in_chunk(int x, int y)
+{
+    return ((y & (CHUNK_SIZE-1)) << CHUNK_BITS) | (x & (CHUNK_SIZE-1));
+}
+
+inline int get_nibble(Uint8 const * chunk, int i)
+{
+    return (chunk[i >> 1] >> ((i & 1) * 4)) & 15;
+}
+
+inline void set_nibble(Uint8 * chunk, int i, int material)
+{
+    int shift = (i & 1) * 4;
+    chunk[i >> 1] = Uint8((chunk[i >> 1] & ~(15 << shift)) | (material << shift));
+}
+
+// Material of a cell inside the map.
+inline int level_cell(int x, int y)
+{
+    Uint8 const * chunk = level.resident[chunk_index(x, y)];
+    if (!chunk) return CELL_UNLOADED;
+    return get_nibble(chunk, cell_in_chunk(x, y));
+}
+
+// Distance-field value of a cell inside the map; 0 means a ray stops here,
+// DIST_MOVER that it has a mover to test.
+inline int level_dist(int x, int y)
+{
+    Sint8 const * dist = level.resident_dist[chunk_index(x, y)];
+    if (!dist) return 0;
+    return dist[cell_in_chunk(x, y)];
+}
+
+const int DOOR_MATERIAL = 3;
+
+int text_cell_material(char c)
+{
+    if (c == '#' || c == 's') return 1;
+    if (c == 'd') return DOOR_MATERIAL;
+    if ('2' <= c && c <= '9') return c - '0';
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return CELL_EMPTY;
+}
+
+// Build the binary image of a level given as text rows.
+std::vector<Uint8> level_image_from_text(std::vector<std::string> const & rows)
+{
+    int w = 0;
+    FOR(y, int(rows.size())) w = std::max(w, int(rows[y].size()));
+    int h = rows.size();
+    int cx = (w + CHUNK_SIZE - 1) >> CHUNK_BITS;
+    int cy = (h + CHUNK_SIZE - 1) >> CHUNK_BITS;
+
+    LevelHeader header;
+    std::memcpy(header.magic, LEVEL_MAGIC, 4);
+    header.version = LEVEL_VERSION;
+    header.width = w;
+    header.height = h;
+    header.chunk_bits = CHUNK_BITS;
+    header.player_x = 1.5f;
+    header.player_y = 1.5f;
+    header.player_angle = 0;
+
+    std::vector<LevelSpawn> spawns;
+    std::vector<Uint8> chunks(size_t(cx) * cy * CHUNK_BYTES, 0);
+    FOR(y, h) {
+        FOR(x, int(rows[y].size())) {
+            char c = rows[y][x];
+            if (c == 'p') {
+                header.player_x = x + 0.5f;
+                header.player_y = y + 0.5f;
+            }
+            if (c == 'f') {
+                LevelSpawn spawn = { x + 0.5f, y + 0.5f, SPAWN_FROG };
+                spawns.push_back(spawn);
+            }
+            if (c == 'd') {
+                // walls west and east mean the way through runs north-south
+                bool walls_x = 0 < x && x+1 < int(rows[y].size()) && text_cell_material(rows[y][x-1]) != CELL_EMPTY && text_cell_material(rows[y][x+1]) != CELL_EMPTY;
+                LevelSpawn spawn = { x + 0.5f, y + 0.5f, Uint32(walls_x ? SPAWN_DOOR_X : SPAWN_DOOR_Y) };
+                spawns.push_back(spawn);
+            }
+            if (c == 's') {
+                LevelSpawn spawn = { x + 0.5f, y + 0.5f, SPAWN_PUSHWALL };
+                spawns.push_back(spawn);
+            }
+            int i = ((y & (CHUNK_SIZE-1)) << CHUNK_BITS) | (x & (CHUNK_SIZE-1));
+            size_t chunk = size_t((y >> CHUNK_BITS) * cx + (x >> CHUNK_BITS)) * CHUNK_BYTES;
+            chunks[chunk + (i >> 1)] |= text_cell_material(c) << ((i & 1) * 4);
+        }
+    }
+    header.num_spawns = spawns.size();
+
+    std::vector<Uint8> image(sizeof(header) + spawns.size() * sizeof(LevelSpawn) + chunks.size());
+    Uint8 * out = &image[0];
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    if (!spawns.empty()) std::memcpy(out, &spawns[0], spawns.size() * sizeof(LevelSpawn));
+    out += spawns.size() * sizeof(LevelSpawn);
+    std::memcpy(out, &chunks[0], chunks.size());
+    return image;
+}
+
+bool read_text_rows(const char * path, std::vector<std::string> & rows)
+{
+    FILE * f = fopen(path, "r");
+    if (!f) return false;
+    std::string row;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '\n') {
+            rows.push_back(row);
+            row.clear();
+        } else if (c != '\r') {
+            row += char(c);
+        }
+    }
+    if (!row.empty()) rows.push_back(row);
+    fclose(f);
+    return true;
+}
+
+void close_level()
+{
+#if HAVE_MMAP
+    if (level.mapped) munmap(const_cast<Uint8 *>(level.image), level.image_size);
+#endif
+    if (level.file) fclose(level.file);
+    level = Level();
+}
+
+// Set up the level once its header and spawns have been read.
+bool init_level(char const * path)
+{
+    LevelHeader const & h = level.header;
+    if (std::memcmp(h.magic, LEVEL_MAGIC, 4) != 0 || h.version != LEVEL_VERSION || h.chunk_bits != CHUNK_BITS ||
+        h.width == 0 || h.height == 0 || h.width > (1 << 24) || h.height > (1 << 24)) {
+        fprintf(stderr, "%s: not a level file this build can read\n", path);
+        return false;
+    }
+    level.width = h.width;
+    level.height = h.height;
+    level.chunks_x = (level.width + CHUNK_SIZE - 1) >> CHUNK_BITS;
+    level.chunks_y = (level.height + CHUNK_SIZE - 1) >> CHUNK_BITS;
+
+    // in 64 bits, which a forged header can't overflow
+    Uint64 num_chunks = Uint64(level.chunks_x) * Uint64(level.chunks_y);
+    Uint64 chunks_offset = sizeof(LevelHeader) + Uint64(h.num_spawns) * sizeof(LevelSpawn);
+    Uint64 level_size = chunks_offset + num_chunks * CHUNK_BYTES;
+    if (num_chunks > MAX_LEVEL_CHUNKS || level_size > Uint64(LONG_MAX)) {
+        fprintf(stderr, "%s: level too big for this build\n", path);
+        return false;
+    }
+    if (level.image_size < level_size) {
+        fprintf(stderr, "%s: truncated level file\n", path);
+        return false;
+    }
+    level.chunks_offset = long(chunks_offset);
+
+    level.resident.assign(num_chunks, NULL);
+    level.resident_dist.assign(num_chunks, NULL);
+    level.resident_slot.assign(num_chunks, -1);
+    level.resident_list.clear();
+    level.slots.assign(size_t(STREAM_SLOTS) * CHUNK_BYTES, 0);
+    level.dist_slots.assign(size_t(STREAM_SLOTS) * CHUNK_CELLS, 0);
+    level.free_slots.clear();
+    FOR(i, STREAM_SLOTS) level.free_slots.push_back(STREAM_SLOTS-1 - i);
+    level.stream_cx = level.stream_cy = -1;
+    return true;
+}
+
+// Read the header and spawns in place from level.image.
+bool init_level_image(char const * path)
+{
+    if (level.image_size < sizeof(LevelHeader)) {
+        fprintf(stderr, "%s: truncated level file\n", path);
+        return false;
+    }
+    std::memcpy(&level.header, level.image, sizeof(LevelHeader));
+    // divide rather than multiply, which could overflow a 32-bit size_t
+    if (level.header.num_spawns > (level.image_size - sizeof(LevelHeader)) / sizeof(LevelSpawn)) {
+        fprintf(stderr, "%s: truncated level file\n", path);
+        return false;
+    }
+    LevelSpawn const * spawns = reinterpret_cast<LevelSpawn const *>(level.image + sizeof(LevelHeader));
+    level.spawns.assign(spawns, spawns + level.header.num_spawns);
+    return init_level(path);
+}
+
+// Use a level file image held in memory.
+bool open_level_image(std::vector<Uint8> image, char const * name)
+{
+    close_level();
+    level.owned_image.swap(image);
+    level.image = level.owned_image.empty() ? NULL : &level.owned_image[0];
+    level.image_size = level.owned_image.size();
+    return init_level_image(name);
+}
+
+// Open a binary level file, or a text level (which is converted in memory).
+bool open_level(const char * path)
+{
+    close_level();
+
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return false;
+    }
+    char magic[4] = { 0 };
+    if (fread(magic, 1, 4, f) != 4 || std::memcmp(magic, LEVEL_MAGIC, 4) != 0) {
+        fclose(f);
+        std::vector<std::string> rows;
+        if (!read_text_rows(path, rows) || rows.empty()) {
+            fprintf(stderr, "%s: empty level\n", path);
+            return false;
+        }
+        return open_level_image(level_image_from_text(rows), path);
+    }
+
+#if HAVE_MMAP
+    fclose(f);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    void * p = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0) p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0) close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map %s\n", path);
+        return false;
+    }
+    level.image = static_cast<Uint8 const *>(p);
+    level.image_size = st.st_size;
+    level.mapped = true;
+    return init_level_image(path);
+#else
+    // no mmap: keep the file open and read chunks as they stream in, once
+    // the header's sizes have been checked against the file's
+    level.file = f;
+    level.spawns.resize(0);
+    long file_size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    level.image_size = file_size > 0 ? size_t(file_size) : 0;
+    rewind(f);
+    bool ok = level.image_size >= sizeof(LevelHeader) && fread(&level.header, sizeof(LevelHeader), 1, f) == 1 &&
+        level.header.num_spawns <= (level.image_size - sizeof(LevelHeader)) / sizeof(LevelSpawn);
+    if (ok) {
+        level.spawns.resize(level.header.num_spawns);
+        ok = level.spawns.empty() || fread(&level.spawns[0], sizeof(LevelSpawn), level.spawns.size(), f) == level.spawns.size();
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: truncated level file\n", path);
+        return false;
+    }
+    return init_level(path);
+#endif
+}
+
+bool open_builtin_level()
+{
+    std::vector<std::string> rows(map_grid, map_grid + MAP_HEIGHT);
+    return open_level_image(level_image_from_text(rows), "built-in level");
+}
+
+// Write the open level out as a binary level file.
+bool export_level(const char * path)
+{
+    if (!level.image) return false;
+    FILE * f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(level.image, 1, level.image_size, f) == level.image_size;
+    return fclose(f) == 0 && ok;
+}
+
+void load_chunk(int chunk)
+{
+    int slot = level.free_slots.back();
+    level.free_slots.pop_back();
+    Uint8 * dst = &level.slots[size_t(slot) * CHUNK_BYTES];
+    size_t offset = level.chunks_offset + size_t(chunk) * CHUNK_BYTES;
+
+    if (level.image) {
+        std::memcpy(dst, level.image + offset, CHUNK_BYTES);
+#if HAVE_MMAP
+        if (level.mapped) {
+            // drop the pages we've copied out of; they're cheap to fault
+            // back in
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t begin = offset / page * page;
+            madvise(const_cast<Uint8 *>(level.image) + begin, offset + CHUNK_BYTES - begin, MADV_DONTNEED);
+        }
+#endif
+    } else if (fseek(level.file, offset, SEEK_SET) != 0 || fread(dst, CHUNK_BYTES, 1, level.file) != 1) {
+        std::memset(dst, 0, CHUNK_BYTES);
+    }
+
+    std::unordered_map<int, std::unordered_map<int, Uint8> >::const_iterator edits = level.edits.find(chunk);
+    if (edits != level.edits.end()) {
+        for (auto const & edit : edits->second) set_nibble(dst, edit.first, edit.second);
+    }
+
+    level.resident[chunk] = dst;
+    level.resident_dist[chunk] = &level.dist_slots[size_t(slot) * CHUNK_CELLS];
+    level.resident_slot[chunk] = slot;
+    level.resident_list.push_back(chunk);
+}
+
+inline int mover_at(int x, int y); // defined with the movers, further down
+
+// Recompute the distance field of the resident cells in [x1, x2] x [y1, y2].
+// A capped distance depends only on cells within DIST_MAX, so only those are
+// looked at. Uses the two-pass 8-neighbour chamfer transform, which is exact
+// for Chebyshev distance.
+void compute_distance(int x1, int y1, int x2, int y2)
+{
+    // cells to write
+    int wx1 = std::max(level.win_x1, x1), wx2 = std::min(level.win_x2 - 1, x2);
+    int wy1 = std::max(level.win_y1, y1), wy2 = std::min(level.win_y2 - 1, y2);
+    if (wx1 > wx2 || wy1 > wy2) return;
+
+    // cells to compute, plus a one-cell border: blocked outside the resident
+    // window, and too far to matter elsewhere
+    int ex1 = std::max(level.win_x1, wx1 - DIST_MAX) - 1, ex2 = std::min(level.win_x2 - 1, wx2 + DIST_MAX) + 1;
+    int ey1 = std::max(level.win_y1, wy1 - DIST_MAX) - 1, ey2 = std::min(level.win_y2 - 1, wy2 + DIST_MAX) + 1;
+    int w = ex2 - ex1 + 1, h = ey2 - ey1 + 1;
+    std::vector<Uint8> & d = level.dist_scratch;
+    d.resize(size_t(w) * h);
+
+    FOR(j, h) {
+        FOR(i, w) {
+            int x = ex1 + i, y = ey1 + j;
+            bool inside = level.win_x1 <= x && x < level.win_x2 && level.win_y1 <= y && y < level.win_y2;
+            bool border = i == 0 || j == 0 || i == w-1 || j == h-1;
+            Uint8 v = DIST_MAX;
+            if (!inside) v = 0;
+            else if (!border && level_cell(x, y) != CELL_EMPTY) v = 0;
+            d[size_t(j) * w + i] = v;
+        }
+    }
+
+    FR(j, 1, h-1) {
+        FR(i, 1, w-1) {
+            Uint8 * c = &d[size_t(j) * w + i];
+            int v = std::min(std::min(int(c[-1]), int(c[-w-1])), std::min(int(c[-w]), int(c[-w+1]))) + 1;
+            if (v < *c) *c = Uint8(v);
+        }
+    }
+    for (int j = h-2; j >= 1; --j) {
+        for (int i = w-2; i >= 1; --i) {
+            Uint8 * c = &d[size_t(j) * w + i];
+            int v = std::min(std::min(int(c[1]), int(c[w+1])), std::min(int(c[w]), int(c[w-1]))) + 1;
+            if (v < *c) *c = Uint8(v);
+        }
+    }
+
+    FR(y, wy1, wy2+1) {
+        FR(x, wx1, wx2+1) {
+            Sint8 v = Sint8(d[size_t(y - ey1) * w + (x - ex1)]);
+            if (v == 0 && mover_at(x, y) >= 0) v = DIST_MOVER;
+            level.resident_dist[chunk_index(x, y)][cell_in_chunk(x, y)] = v;
+        }
+    }
+}
+
+const size_t MAX_CHANGED_CELLS = 4096;
+
+void note_changed_cell(int x, int y)
+{
+    if (level.changed_cells.size() < MAX_CHANGED_CELLS) level.changed_cells.push_back(std::make_pair(x, y));
+    else level.changed_cells_lost = true;
+}
+
+// Update the distance field after the cells in [x1, x2] x [y1, y2] changed.
+void update_distance(int x1, int y1, int x2, int y2)
+{
+    compute_distance(x1 - DIST_MAX, y1 - DIST_MAX, x2 + DIST_MAX, y2 + DIST_MAX);
+}
+
+// Change a cell of the level. The edit survives the chunk being evicted and
+// reloaded. Must not run while a raycast is in flight.
+void set_cell(int x, int y, int material)
+{
+    if (x < 0 || level.width <= x || y < 0 || level.height <= y) return;
+    int chunk = chunk_index(x, y);
+    level.edits[chunk][cell_in_chunk(x, y)] = Uint8(material);
+    if (!level.resident[chunk]) return;
+    set_nibble(level.resident[chunk], cell_in_chunk(x, y), material);
+    update_distance(x, y, x, y);
+    note_changed_cell(x, y);
+    ++level.revision;
+}
+
+// The chunk the resident set is centred on for a viewer at (x, y).
+int stream_centre(double x, double y)
+{
+    int pcx = std::max(0, std::min(saturate_int(floor(x)) >> CHUNK_BITS, level.chunks_x-1));
+    int pcy = std::max(0, std::min(saturate_int(floor(y)) >> CHUNK_BITS, level.chunks_y-1));
+    return pcy * level.chunks_x + pcx;
+}
+
+// Make the chunks within STREAM_RADIUS of the one containing (x, y) resident
+// and evict the rest. Must not run while a raycast is in flight.
+void stream_chunks(double x, double y)
+{
+    int centre = stream_centre(x, y);
+    int pcx = centre % level.chunks_x;
+    int pcy = centre / level.chunks_x;
+    if (pcx == level.stream_cx && pcy == level.stream_cy) return;
+    level.stream_cx = pcx;
+    level.stream_cy = pcy;
+
+    int x1 = std::max(0, pcx - STREAM_RADIUS), x2 = std::min(level.chunks_x-1, pcx + STREAM_RADIUS);
+    int y1 = std::max(0, pcy - STREAM_RADIUS), y2 = std::min(level.chunks_y-1, pcy + STREAM_RADIUS);
+
+    std::vector<int> & list = level.resident_list;
+    for (size_t i = 0; i < list.size(); ) {
+        int chunk = list[i];
+        int ccx = chunk % level.chunks_x, ccy = chunk / level.chunks_x;
+        if (x1 <= ccx && ccx <= x2 && y1 <= ccy && ccy <= y2) {
+            ++i;
+            continue;
+        }
+        level.free_slots.push_back(level.resident_slot[chunk]);
+        level.resident[chunk] = NULL;
+        level.resident_dist[chunk] = NULL;
+        level.resident_slot[chunk] = -1;
+        list[i] = list.back();
+        list.pop_back();
+    }
+
+    FR(ccy, y1, y2+1) {
+        FR(ccx, x1, x2+1) {
+            int chunk = ccy * level.chunks_x + ccx;
+            if (!level.resident[chunk]) load_chunk(chunk);
+        }
+    }
+
+    // The window only moves when the player crosses into another chunk, and
+    // then most of the field near its edges changes, so rebuild all of it.
+    level.win_x1 = x1 << CHUNK_BITS;
+    level.win_y1 = y1 << CHUNK_BITS;
+    level.win_x2 = std::min(level.width, (x2+1) << CHUNK_BITS);
+    level.win_y2 = std::min(level.height, (y2+1) << CHUNK_BITS);
+    compute_distance(level.win_x1, level.win_y1, level.win_x2 - 1, level.win_y2 - 1);
+    ++level.revision;
+    ++level.resident_revision;
+}
+
+const double EPS = 1e-8;
+
+const double PLAYER_MOVE_SPEED = 2.0;
+
+double player_x;
+double player_y;
+double player_angle; // in interval [0,1)
+
+// A camera a frame is drawn from. The game's, `view`, is set from the
+// player's interpolated pose before each frame and the render code reads
+// nothing else, so a frame can be drawn while the simulation moves the
+// player on.
+struct Camera
+{
+    double x, y;
+    double angle;
+    double dx, dy; // unit view direction
+};
+Camera view;
+
+Camera make_camera(double x, double y, double angle)
+{
+    Camera cam;
+    cam.x = x;
+    cam.y = y;
+    cam.angle = angle;
+    cam.dx = cos(2*M_PI * angle);
+    cam.dy = sin(2*M_PI * angle);
+    return cam;
+}
+
+void set_view(double x, double y, double angle)
+{
+    view = make_camera(x, y, angle);
+}
+
+struct Vector3D {
+    real x,y,z;
+};
+
+struct SceneRect {
+    real z,x,y,w,h;
+};
+
+struct ViewRect {
+    real x,y,w,h;
+};
+
+Vector3D world_to_scene(Camera const & cam, Vector3D v_world)
+{
+    real px = cam.x;
+    real py = cam.y;
+    real pdx = cam.dx;
+    real pdy = cam.dy;
+
+    Vector3D v_scene;
+    v_scene.z = pdx * (v_world.x - px) + pdy * (v_world.y - py);
+    v_scene.x = -pdy * (v_world.x - px) + pdx * (v_world.y - py);
+    v_scene.y = -v_world.z;
+    return v_scene;
+}
+
+ViewRect scene_to_view(SceneRect r_scene)
+{
+    ViewRect r_view;
+    r_view.x = r_scene.x / r_scene.z;
+    r_view.y = r_scene.y / r_scene.z;
+    r_view.w = r_scene.w / r_scene.z;
+    r_view.h = r_scene.h / r_scene.z;
+    return r_view;
+}
+
+void wrap_angle(double & angle) {
+    double intpart;
+    double fracpart = modf(angle, &intpart);
+    if (fracpart < 0) fracpart += 1;
+
+    angle = fracpart;
+}
+
+double deltaFrame_s;
+
+// Rendering backends. The SDL backend issues one renderer call per column and
+// per tile; the software backend draws everything into the renderer's pixel
+// buffer and uploads it with a single SDL_UpdateTexture per frame. With
+// indexed_color the software backend draws palette indices instead.
+enum RenderBackend { BACKEND_SDL, BACKEND_SOFTWARE };
+RenderBackend backend = BACKEND_SOFTWARE;
+bool indexed_color = false;
+
+const char * backend_name()
+{
+    return backend == BACKEND_SDL ? "sdl" : indexed_color ? "sw8" : "sw";
+}
+
+// Ray-casting kernels; the scalar one stays available to check the SIMD one.
+// There's no SIMD kernel for fixed point. Under Emscripten it needs
+// -msimd128: without it the vectors are lowered to scalar code that is slower
+// than the scalar kernel.
+#if defined(__GNUC__) && RAYCAST_REAL != REAL_FIXED && (!defined(__EMSCRIPTEN__) || defined(__wasm_simd128__))
+#define HAVE_RAY_SIMD 1
+#else
+#define HAVE_RAY_SIMD 0
+#endif
+
+enum RayKernel { KERNEL_SCALAR, KERNEL_SIMD };
+RayKernel ray_kernel = HAVE_RAY_SIMD ? KERNEL_SIMD : KERNEL_SCALAR;
+
+const char * ray_kernel_name()
+{
+    return ray_kernel == KERNEL_SIMD ? "simd" : "scalar";
+}
+
+// How the native loop paces frames; see main_loop().
+enum PresentMode { PRESENT_VSYNC, PRESENT_UNCAPPED, PRESENT_CAPPED };
+PresentMode present_mode = PRESENT_VSYNC;
+double capped_fps = 60;
+
+// Draw the world on a render thread while the previous frame is presented;
+// see RenderThread.
+bool pipeline_frames = false;
+
+const char * present_mode_name()
+{
+    return present_mode == PRESENT_VSYNC ? "vsync" : present_mode == PRESENT_UNCAPPED ? "uncapped" : "capped";
+}
+
+Uint32 rgba8888(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+    return (Uint32(r) << 24) | (Uint32(g) << 16) | (Uint32(b) << 8) | a;
+}
+
+// Doors and pushwalls
+// Both stay solid cells in the grid while they move, so the distance field
+// still stops rays at them and needs no update as they animate. A ray that
+// stops at one of their cells tests the mover's box instead of the cell: a
+// door is a slab across the middle of its cell that slides along it into the
+// wall, and a pushwall is a whole cell that slides to the next one. A door
+// opens when used, waits, and closes again once the player is out of the
+// way; a pushwall moves up to PUSHWALL_CELLS cells away from the player, as
+// long as the way is clear. Only a pushwall entering or leaving a cell edits
+// the grid, through set_cell(), so the distance field and the minimap only
+// ever see single-cell changes.
+enum MoverKind { MOVER_DOOR, MOVER_PUSHWALL };
+
+const double DOOR_SPEED = 1.0; // cells per second
+const double DOOR_OPEN_S = 3.0;
+const double PUSHWALL_SPEED = 0.5;
+const int PUSHWALL_CELLS = 2;
+
+struct Mover
+{
+    MoverKind kind;
+    int x, y;   // the cell it's in; a moving pushwall also covers (x+dx, y+dy)
+    int dx, dy; // the way it slides
+    int material;  // a pushwall's, once it's pushed
+    double offset; // how far it has slid, in cells
+    double target; // a door's offset to slide to: 0 closed, 1 open
+    double wait_s; // how long an open door stays open
+    int cells_left;
+    bool moving;
+    real x1, y1, x2, y2; // its box, in world coordinates
+};
+std::vector<Mover> movers;
+std::unordered_map<long long, int> mover_cells; // cell y*width+x -> movers index
+std::vector<int> moving_movers;
+
+long long mover_key(int x, int y)
+{
+    return (long long)y * level.width + x;
+}
+
+// Index of the mover in cell (x, y), or -1.
+inline int mover_at(int x, int y)
+{
+    if (mover_cells.empty()) return -1;
+    std::unordered_map<long long, int>::const_iterator it = mover_cells.find(mover_key(x, y));
+    return it == mover_cells.end() ? -1 : it->second;
+}
+
+// Put mover i in cell (x, y), or with i < 0 take out the one there, marking
+// the cell in the distance field if it's resident.
+void set_mover_cell(int x, int y, int i)
+{
+    if (i >= 0) mover_cells[mover_key(x, y)] = i;
+    else mover_cells.erase(mover_key(x, y));
+    Sint8 * dist = level.resident_dist[chunk_index(x, y)];
+    if (!dist) return;
+    Sint8 & d = dist[cell_in_chunk(x, y)];
+    if (i >= 0 && d == 0) d = DIST_MOVER;
+    if (i < 0 && d == DIST_MOVER) d = 0;
+}
+
+void update_mover_box(Mover & m)
+{
+    double x = m.x + m.dx * m.offset, y = m.y + m.dy * m.offset;
+    if (m.kind == MOVER_DOOR) {
+        // zero thickness across the way through
+        if (m.dx) m.x1 = real(x), m.x2 = real(x + 1), m.y1 = m.y2 = real(y + 0.5);
+        else m.y1 = real(y), m.y2 = real(y + 1), m.x1 = m.x2 = real(x + 0.5);
+    } else {
+        m.x1 = real(x), m.x2 = real(x + 1);
+        m.y1 = real(y), m.y2 = real(y + 1);
+    }
+}
+
+void add_mover(MoverKind kind, int x, int y, int dx, int dy)
+{
+    if (x < 0 || level.width <= x || y < 0 || level.height <= y) return;
+    Mover m;
+    m.kind = kind;
+    m.x = x, m.y = y;
+    m.dx = dx, m.dy = dy;
+    m.material = CELL_EMPTY;
+    m.offset = m.target = m.wait_s = 0;
+    m.cells_left = PUSHWALL_CELLS;
+    m.moving = false;
+    update_mover_box(m);
+    set_mover_cell(x, y, int(movers.size()));
+    movers.push_back(m);
+}
+
+void start_mover(int i)
+{
+    if (movers[i].moving) return;
+    movers[i].moving = true;
+    moving_movers.push_back(i);
+}
+
+bool door_open(Mover const & m)
+{
+    return m.kind == MOVER_DOOR && m.offset >= 1;
+}
+
+bool player_in_cell(int x, int y)
+{
+    return floor_to_int(player_x) == x && floor_to_int(player_y) == y;
+}
+
+// Use the door or pushwall in the cell the player faces.
+void use_mover()
+{
+    double c = cos(2*M_PI * player_angle), s = sin(2*M_PI * player_angle);
+    int dx = 0, dy = 0;
+    if (fabs(c) >= fabs(s)) dx = c > 0 ? 1 : -1;
+    else dy = s > 0 ? 1 : -1;
+    int x = floor_to_int(player_x) + dx, y = floor_to_int(player_y) + dy;
+    int i = mover_at(x, y);
+    if (i < 0) return;
+
+    Mover & m = movers[i];
+    if (m.kind == MOVER_DOOR) {
+        m.target = 1;
+        start_mover(i);
+        return;
+    }
+
+    if (m.moving || m.cells_left <= 0) return;
+    int nx = x + dx, ny = y + dy;
+    if (nx < 0 || level.width <= nx || ny < 0 || level.height <= ny) return;
+    if (level_cell(nx, ny) != CELL_EMPTY || mover_at(nx, ny) >= 0) return;
+    m.dx = dx, m.dy = dy;
+    m.material = level_cell(x, y);
+    set_cell(nx, ny, m.material);
+    set_mover_cell(nx, ny, i);
+    start_mover(i);
+}
+
+// Advance the moving doors and pushwalls by dt seconds.
+void update_movers(double dt)
+{
+    bool moved = false;
+    for (size_t k = 0; k < moving_movers.size(); ) {
+        int i = moving_movers[k];
+        Mover & m = movers[i];
+        bool was_open = door_open(m);
+        double old_offset = m.offset;
+
+        if (m.kind == MOVER_DOOR) {
+            if (m.target > 0 && m.offset >= 1) {
+                m.wait_s -= dt;
+                if (m.wait_s <= 0 && !player_in_cell(m.x, m.y)) m.target = 0;
+            } else if (m.target > 0) {
+                m.offset = std::min(1.0, m.offset + DOOR_SPEED * dt);
+                if (m.offset >= 1) m.wait_s = DOOR_OPEN_S;
+            } else if (player_in_cell(m.x, m.y)) {
+                m.target = 1; // don't close on the player
+            } else {
+                m.offset = std::max(0.0, m.offset - DOOR_SPEED * dt);
+                if (m.offset <= 0) m.moving = false;
+            }
+            if (door_open(m) != was_open) note_changed_cell(m.x, m.y);
+        } else {
+            m.offset += PUSHWALL_SPEED * dt;
+            if (m.offset >= 1) {
+                // arrived in the next cell; carry on if the way is clear
+                set_mover_cell(m.x, m.y, -1);
+                set_cell(m.x, m.y, CELL_EMPTY);
+                m.x += m.dx, m.y += m.dy;
+                m.offset = 0;
+                --m.cells_left;
+                int nx = m.x + m.dx, ny = m.y + m.dy;
+                bool clear = m.cells_left > 0 && 0 <= nx && nx < level.width && 0 <= ny && ny < level.height &&
+                    level_cell(nx, ny) == CELL_EMPTY && mover_at(nx, ny) < 0;
+                if (clear) {
+                    set_cell(nx, ny, m.material);
+                    set_mover_cell(nx, ny, i);
+                } else {
+                    m.moving = false;
+                }
+            }
+        }
+
+        if (m.offset != old_offset) {
+            update_mover_box(m);
+            moved = true;
+        }
+        if (m.moving) {
+            ++k;
+        } else {
+            moving_movers[k] = moving_movers.back();
+            moving_movers.pop_back();
+        }
+    }
+    if (moved) ++level.revision;
+}
+
+// Collision
+// The player is a circle of PLAYER_RADIUS that can't overlap a blocking cell.
+// A move is split into steps of at most half the radius, so it can't pass
+// through a wall, and after each step the circle is pushed back out of the
+// cells round it, which makes it slide along walls. Like the ray-caster, it
+// uses the distance field to skip the work in open space: a cell whose
+// distance is 2 or more has nothing to collide with round it.
+const double PLAYER_RADIUS = 0.25;
+
+// Whether nothing can stand in cell (x, y): outside the map, not resident,
+// solid, or a door that isn't fully open.
+bool cell_blocks(int x, int y)
+{
+    if (x < 0 || level.width <= x || y < 0 || level.height <= y) return true;
+    int material = level_cell(x, y);
+    if (material == CELL_EMPTY) return false;
+    if (material == CELL_UNLOADED) return true;
+    int m = mover_at(x, y);
+    return m < 0 || !door_open(movers[m]);
+}
+
+// Push a circle at (x, y) out of cell (cx, cy) if it overlaps it.
+void push_out_of_cell(double & x, double & y, double radius, int cx, int cy)
+{
+    double px = std::max(double(cx), std::min(x, cx + 1.0));
+    double py = std::max(double(cy), std::min(y, cy + 1.0));
+    double dx = x - px, dy = y - py;
+    double d2 = dx*dx + dy*dy;
+    if (d2 >= radius*radius) return;
+    if (d2 > 0) {
+        double d = sqrt(d2);
+        x = px + dx / d * radius;
+        y = py + dy / d * radius;
+        return;
+    }
+
+    // the centre is inside the cell: out through the nearest side
+    double west = x - cx, east = cx + 1 - x, north = y - cy, south = cy + 1 - y;
+    double nearest = std::min(std::min(west, east), std::min(north, south));
+    if (nearest == west) x = cx - radius;
+    else if (nearest == east) x = cx + 1 + radius;
+    else if (nearest == north) y = cy - radius;
+    else y = cy + 1 + radius;
+}
+
+// Push a circle of radius < 1 at (x, y) out of the blocking cells round it:
+// the sides first, then the corners, so it slides past the joins between
+// wall cells instead of catching on them.
+void resolve_circle(double & x, double & y, double radius)
+{
+    int cx = floor_to_int(x), cy = floor_to_int(y);
+    bool inside = 0 <= cx && cx < level.width && 0 <= cy && cy < level.height;
+    if (inside && level_dist(cx, cy) >= 2) return;
+
+    static const int order[9][2] = {
+        {0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1},
+    };
+    FOR(i, 9) {
+        int nx = cx + order[i][0], ny = cy + order[i][1];
+        if (cell_blocks(nx, ny)) push_out_of_cell(x, y, radius, nx, ny);
+    }
+}
+
+// Move a circle of radius < 1 at (x, y) by (dx, dy), sliding along whatever
+// it runs into.
+void move_circle(double & x, double & y, double dx, double dy, double radius)
+{
+    double len = std::max(fabs(dx), fabs(dy));
+    int steps = std::max(1, int(ceil(len / (0.5 * radius))));
+    FOR(i, steps) {
+        x += dx / steps;
+        y += dy / steps;
+        resolve_circle(x, y, radius);
+    }
+}
+
+void moveplayer(double amt, double angle)
+{
+    amt *= deltaFrame_s;
+    move_circle(player_x, player_y, amt * cos(2*M_PI * angle), amt * sin(2*M_PI * angle), PLAYER_RADIUS);
+}
+
+void moveplayer(double amt)
+{
+    moveplayer(amt, player_angle);
+}
+
+void strafeplayer(double amt)
+{
+    double angle = player_angle + 0.25;
+    wrap_angle(angle);
+    moveplayer(amt, angle);
+}
+
+void rotateplayer(double amt)
+{
+    amt *= deltaFrame_s;
+    player_angle += amt;
+    wrap_angle(player_angle);
+}
+
+// Entities
+// Stored as parallel arrays, and bucketed by grid cell (1 << ENTITY_CELL_BITS
+// map cells across) so the sprite pass only looks at the cells under the view
+// frustum. Grid cells are hashed into a fixed number of buckets rather than
+// laid out over the whole level, which may be far bigger than the part that's
+// streamed in.
+//
+// What a view sees is kept per renderer (VisibleEntities). Its visible list
+// keeps last frame's far-to-near order, so re-sorting it is an insertion sort
+// over a list that's already almost in order.
+const int ENTITY_CELL_BITS = 3;
+const int ENTITY_BUCKETS = 4096;
+
+struct Entities
+{
+    // per entity
+    std::vector<real> x, y, z;          // world position of the base
+    std::vector<real> width, height;    // in scene units
+    std::vector<Texture *> sprite;
+    std::vector<int> bucket, prev, next; // bucket list links, -1 at the ends
+
+    std::vector<int> bucket_head;
+    real max_width; // of any entity, for looking round a point
+
+    Entities() : bucket_head(ENTITY_BUCKETS, -1), max_width(0) {}
+
+    int size() const
+    {
+        return static_cast<int>(x.size());
+    }
+};
+Entities entities;
+
+// The entities one view found this frame.
+struct VisibleEntities
+{
+    // per entity
+    std::vector<Vector3D> scene;
+    std::vector<Uint32> found_frame, listed_frame;
+
+    std::vector<int> visible; // far to near
+    std::vector<int> merged;
+    Uint32 frame;
+
+    VisibleEntities() : frame(0) {}
+};
+
+int entity_grid_cell(double v)
+{
+    return floor_to_int(v) >> ENTITY_CELL_BITS;
+}
+
+int entity_bucket(int gx, int gy)
+{
+    return int((Uint32(gx) * 73856093u ^ Uint32(gy) * 19349663u) & (ENTITY_BUCKETS - 1));
+}
+
+void link_entity(int i)
+{
+    Entities & es = entities;
+    int b = entity_bucket(entity_grid_cell(to_double(es.x[i])), entity_grid_cell(to_double(es.y[i])));
+    es.bucket[i] = b;
+    es.prev[i] = -1;
+    es.next[i] = es.bucket_head[b];
+    if (es.next[i] >= 0) es.prev[es.next[i]] = i;
+    es.bucket_head[b] = i;
+}
+
+void unlink_entity(int i)
+{
+    Entities & es = entities;
+    if (es.prev[i] >= 0) es.next[es.prev[i]] = es.next[i];
+    else es.bucket_head[es.bucket[i]] = es.next[i];
+    if (es.next[i] >= 0) es.prev[es.next[i]] = es.prev[i];
+}
+
+int add_entity(Texture & sprite, double x, double y)
+{
+    Entities & es = entities;
+    int i = es.size();
+    es.x.push_back(x);
+    es.y.push_back(y);
+    es.z.push_back(real(-0.5));
+    es.width.push_back(real(0.8)); // TODO
+    es.height.push_back(real(0.8));
+    es.sprite.push_back(&sprite);
+    if (es.max_width < es.width[i]) es.max_width = es.width[i];
+    es.bucket.push_back(-1);
+    es.prev.push_back(-1);
+    es.next.push_back(-1);
+    link_entity(i);
+    return i;
+}
+
+void move_entity(int i, double x, double y)
+{
+    Entities & es = entities;
+    bool same_cell = entity_grid_cell(to_double(es.x[i])) == entity_grid_cell(x) && entity_grid_cell(to_double(es.y[i])) == entity_grid_cell(y);
+    if (!same_cell) unlink_entity(i);
+    es.x[i] = x;
+    es.y[i] = y;
+    if (!same_cell) link_entity(i);
+}
+
+// Replace the entities, doors and pushwalls with the ones the level's spawns
+// ask for.
+void spawn_level()
+{
+    entities = Entities();
+    movers.clear();
+    mover_cells.clear();
+    moving_movers.clear();
+    FOR(i, int(level.spawns.size())) {
+        LevelSpawn const & spawn = level.spawns[i];
+        if (spawn.kind == SPAWN_FROG) {
+            add_entity(frog_sprite, spawn.x, spawn.y);
+        }
+        int cx = floor_to_int(double(spawn.x)), cy = floor_to_int(double(spawn.y));
+        if (spawn.kind == SPAWN_DOOR_X) add_mover(MOVER_DOOR, cx, cy, 1, 0);
+        if (spawn.kind == SPAWN_DOOR_Y) add_mover(MOVER_DOOR, cx, cy, 0, 1);
+        if (spawn.kind == SPAWN_PUSHWALL) add_mover(MOVER_PUSHWALL, cx, cy, 1, 0);
+    }
+    // drop the old movers' marks from the distance field
+    if (!level.resident_list.empty()) compute_distance(level.win_x1, level.win_y1, level.win_x2 - 1, level.win_y2 - 1);
+}
+
+bool show_profile_overlay = false;
+bool textured_floor = true;
+bool reproject_columns = false;
+
+// Which extra camera the game draws; see Views.
+enum ViewLayout { VIEWS_SINGLE, VIEWS_SPLIT, VIEWS_MIRROR, VIEW_LAYOUTS };
+ViewLayout view_layout = VIEWS_SINGLE;
+
+const char * view_layout_name()
+{
+    return view_layout == VIEWS_SPLIT ? "split" : view_layout == VIEWS_MIRROR ? "mirror" : "single";
+}
+
+bool quitRequested;
+void handle_events()
+{
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            quitRequested = true;
+        }
+
+        if (e.type == SDL_KEYDOWN) {
+            if (e.key.keysym.sym == SDLK_ESCAPE) {
+                quitRequested = true;
+            }
+            if (e.key.keysym.sym == SDLK_b) {
+                backend = (backend == BACKEND_SDL) ? BACKEND_SOFTWARE : BACKEND_SDL;
+            }
+            if (e.key.keysym.sym == SDLK_k && HAVE_RAY_SIMD) {
+                ray_kernel = (ray_kernel == KERNEL_SIMD) ? KERNEL_SCALAR : KERNEL_SIMD;
+            }
+            if (e.key.keysym.sym == SDLK_f) {
+                textured_floor = !textured_floor;
+            }
+            if (e.key.keysym.sym == SDLK_i) {
+                indexed_color = !indexed_color;
+            }
+            if (e.key.keysym.sym == SDLK_r) {
+                reproject_columns = !reproject_columns;
+            }
+            if (e.key.keysym.sym == SDLK_v) {
+                view_layout = ViewLayout((view_layout + 1) % VIEW_LAYOUTS);
+            }
+            if (e.key.keysym.sym == SDLK_g) {
+                show_profile_overlay = !show_profile_overlay;
+            }
+            if (e.key.keysym.sym == SDLK_p) {
+                start_trace();
+            }
+        }
+    }
+}
+
+const double FOV = 0.25; // in interval [0,1)
+
+// Renderer
+// Everything drawing a frame needs besides the world: its camera and target,
+// its settings, and its per-column and per-sprite scratch. The world (the
+// level, the entities and the textures) is only read, so several renderers
+// can draw at once on different threads as long as nothing edits or streams
+// the level meanwhile. The software backend makes no SDL calls; the SDL
+// backend is only for the game's renderer, on the main thread.
+
+// Per-column ray offsets along the camera plane. They depend only on the FOV
+// and the column count, so they're rebuilt only when one of those changes.
+struct RayTable
+{
+    double fov;
+    int cols;
+    double screen_tan_max;
+    std::vector<real> col_tan;
+
+    RayTable() : fov(0), cols(0), screen_tan_max(0) {}
+};
+
+// What the ray through each screen column hit; dist is 0 for no hit.
+struct ColumnHit
+{
+    real x, y;
+    real dist;
+    int color;
+    int material;
+    real tex_u;
+};
+
+// Last frame's columns, for the next one to reuse; see Column reuse.
+struct ColumnCache
+{
+    bool valid;
+    Camera camera; // that the columns were cast from
+    int cols;
+    double fov;
+    unsigned revision; // of the level
+    RayKernel kernel; // that cast them
+    ColumnHit hits[TILE_COLS];
+    double ray_angle[TILE_COLS]; // world direction of each column's ray, in radians
+};
+
+struct Renderer
+{
+    // set by the caller before each frame
+    Camera camera;
+    double fov;
+    int cols, rows;    // at most TILE_COLS x TILE_ROWS
+    Uint32 * pixels;   // software target, rows `pitch` pixels apart
+    Uint8 * indices;   // the same as palette indices, used instead when indexed
+    int pitch;
+    RenderBackend backend;
+    bool indexed;
+    bool textured_floor;
+    bool reproject;    // reuse columns when only turning; see Column reuse
+
+    // results of the last frame
+    double phase_ms[PHASE_COUNT]; // the world phases, from render_frame()
+    int columns_cast;
+
+    // scratch
+    RayTable ray_table;
+    double screen_tan_max;
+    Uint32 draw_color;
+    Uint8 draw_index;
+    ColumnHit column_hits[TILE_COLS];
+    real column_dist[TILE_COLS];
+    ColumnCache column_cache;
+    bool column_stale[TILE_COLS]; // still to be cast this frame
+    double column_ray_angle[TILE_COLS];
+    int first_plane_row; // the floor rows above it are hidden by walls
+    VisibleEntities entities;
+    Uint16 sprite_next[TILE_COLS][TILE_ROWS+1]; // see Sprites
+    unsigned sprite_next_frame[TILE_COLS];
+    unsigned sprite_frame;
+    FrameArena arena; // reset as each frame starts
+
+    Renderer() : camera(make_camera(0, 0, 0)), fov(FOV), cols(TILE_COLS), rows(TILE_ROWS), pixels(NULL), indices(NULL), pitch(TILE_COLS),
+        backend(BACKEND_SOFTWARE), indexed(false), textured_floor(true), reproject(false), phase_ms(), columns_cast(0),
+        column_cache(), first_plane_row(0), sprite_next_frame(), sprite_frame(0) {}
+
+    Uint32 * pixel_row(int y)
+    {
+        return pixels + y * pitch;
+    }
+
+    Uint8 * index_row(int y)
+    {
+        return indices + y * pitch;
+    }
+
+    double tile_per_view() const
+    {
+        return (cols-1) / (2.0 * screen_tan_max);
+    }
+};
+
+// Views drawn together in one frame; see render_views().
+const int MAX_VIEWS = 4;
+
+// Run fn(view, i1, i2) over [0, counts[v]) of each of the views, all in one
+// parallel_for over the combined range, so small views don't leave threads
+// idle. Without a pool, runs on this thread.
+void parallel_for_views(ThreadPool * pool, Renderer * const * views, int num_views, int const * counts,
+    std::function<void(Renderer &, int, int)> const & fn)
+{
+    int total = 0;
+    FOR(v, num_views) total += counts[v];
+    if (total == 0) return;
+    struct Job
+    {
+        Renderer * const * views;
+        int num_views;
+        int const * counts;
+        std::function<void(Renderer &, int, int)> const & fn;
+    } job = { views, num_views, counts, fn };
+    // capturing one reference lets std::function hold it without allocating
+    auto bands = [&job](int i1, int i2) {
+        int start = 0;
+        FOR(v, job.num_views) {
+            int a = std::max(i1 - start, 0);
+            int b = std::min(i2 - start, job.counts[v]);
+            if (a < b) job.fn(*job.views[v], a, b);
+            start += job.counts[v];
+        }
+    };
+    if (pool) pool->parallel_for(total, bands);
+    else bands(0, total);
+}
+
+void update_ray_table(Renderer & r)
+{
+    RayTable & table = r.ray_table;
+    if (table.fov == r.fov && table.cols == r.cols) return;
+
+    table.fov = r.fov;
+    table.cols = r.cols;
+    table.screen_tan_max = tan(2*M_PI * r.fov/2);
+    table.col_tan.resize(r.cols);
+    FOR(screen_col, r.cols) {
+        table.col_tan[screen_col] = -table.screen_tan_max + 2*table.screen_tan_max * screen_col / (r.cols-1);
+    }
+}
+
+SDL_Rect view_to_sdl(Renderer const & r, ViewRect r_view)
+{
+    real tile_per_view = r.tile_per_view();
+
+    SDL_Rect r_sdl;
+    r_sdl.x = round_to_int((r_view.x) * tile_per_view + real(r.cols/2.0));
+    r_sdl.y = round_to_int((r_view.y) * tile_per_view + real(r.rows/2.0));
+    int x2 = round_to_int((r_view.x + r_view.w) * tile_per_view + real(r.cols/2.0));
+    int y2 = round_to_int((r_view.y + r_view.h) * tile_per_view + real(r.rows/2.0));
+    r_sdl.w = x2 - r_sdl.x;
+    r_sdl.h = y2 - r_sdl.y;
+    return r_sdl;
+}
+
+void setdrawcolor(Renderer & r, Uint8 red, Uint8 green, Uint8 blue)
+{
+    if (r.backend == BACKEND_SDL) {
+        CHECK_SDL(SDL_SetRenderDrawColor(ren, red, green, blue, 255));
+    } else {
+        r.draw_color = rgba8888(red, green, blue, 255);
+        if (r.indexed) r.draw_index = nearest_index(r.draw_color);
+    }
+}
+
+// Find the entities in front of the camera that can show on screen nearer
+// than `far`, put their scene coordinates in r.entities.scene, and list them
+// far to near in r.entities.visible.
+void collect_visible_entities(Renderer & r, double far)
+{
+    Entities const & es = entities;
+    VisibleEntities & vis = r.entities;
+    Camera const & cam = r.camera;
+    ++vis.frame;
+    vis.scene.resize(es.size());
+    vis.found_frame.resize(es.size());
+    vis.listed_frame.resize(es.size());
+    vis.visible.reserve(es.size());
+    vis.merged.reserve(es.size());
+
+    // each entity is in one grid cell, and each cell is visited once
+    int * found = r.arena.alloc<int>(es.size());
+    int num_found = 0;
+
+    // Cull in world space against the frustum, widened by a column at each
+    // edge so rounding in view_to_sdl can't lose a sprite that touches it.
+    double tan_cull = r.screen_tan_max * (r.cols + 1) / (r.cols - 1);
+    double reach = 0.5; // covers the widest sprite
+    double ex = -cam.dy * tan_cull, ey = cam.dx * tan_cull;
+    double xs[3] = { cam.x, cam.x + far * (cam.dx - ex), cam.x + far * (cam.dx + ex) };
+    double ys[3] = { cam.y, cam.y + far * (cam.dy - ey), cam.y + far * (cam.dy + ey) };
+    int gx1 = entity_grid_cell(*std::min_element(xs, xs + 3) - reach), gx2 = entity_grid_cell(*std::max_element(xs, xs + 3) + reach);
+    int gy1 = entity_grid_cell(*std::min_element(ys, ys + 3) - reach), gy2 = entity_grid_cell(*std::max_element(ys, ys + 3) + reach);
+
+    // more grid cells than buckets would visit buckets more than once
+    if ((double(gx2) - gx1 + 1) * (double(gy2) - gy1 + 1) > ENTITY_BUCKETS) {
+        gx1 = gy1 = 0;
+        gx2 = gy2 = -1;
+        FOR(i, es.size()) found[num_found++] = i;
+    }
+
+    FR(gy, gy1, gy2+1) {
+        FR(gx, gx1, gx2+1) {
+            for (int i = es.bucket_head[entity_bucket(gx, gy)]; i >= 0; i = es.next[i]) {
+                if (entity_grid_cell(to_double(es.x[i])) == gx && entity_grid_cell(to_double(es.y[i])) == gy) found[num_found++] = i;
+            }
+        }
+    }
+
+    int kept = 0;
+    FOR(k, num_found) {
+        int i = found[k];
+        double rx = to_double(es.x[i]) - cam.x, ry = to_double(es.y[i]) - cam.y;
+        double z = cam.dx * rx + cam.dy * ry;
+        double x = -cam.dy * rx + cam.dx * ry;
+        double half_w = to_double(es.width[i]) / 2;
+        if (z <= 0 || z - half_w > far || std::abs(x) - half_w > z * tan_cull) continue;
+
+        Vector3D world = { es.x[i], es.y[i], es.z[i] };
+        vis.scene[i] = world_to_scene(cam, world);
+        if (!(vis.scene[i].z > real(EPS))) continue;
+        vis.found_frame[i] = vis.frame;
+        found[kept++] = i;
+    }
+    num_found = kept;
+
+    // Keep last frame's order for what's still visible and fix it up with an
+    // insertion sort; sort what's newly visible and merge it in.
+    int n = 0;
+    FOR(k, int(vis.visible.size())) {
+        int i = vis.visible[k];
+        if (vis.found_frame[i] != vis.frame) continue;
+        vis.listed_frame[i] = vis.frame;
+        vis.visible[n++] = i;
+    }
+    vis.visible.resize(n);
+
+    FR(k, 1, n) {
+        int i = vis.visible[k];
+        real z = vis.scene[i].z;
+        int j = k;
+        for (; j > 0 && vis.scene[vis.visible[j-1]].z < z; --j) vis.visible[j] = vis.visible[j-1];
+        vis.visible[j] = i;
+    }
+
+    int m = 0;
+    FOR(k, num_found) {
+        int i = found[k];
+        if (vis.listed_frame[i] != vis.frame) found[m++] = i;
+    }
+    if (m == 0) return;
+
+    auto farther = [&vis](int a, int b) { return vis.scene[a].z > vis.scene[b].z; };
+    std::sort(found, found + m, farther);
+    vis.merged.resize(n + m);
+    std::merge(BEND(vis.visible), found, found + m, vis.merged.begin(), farther);
+    vis.visible.swap(vis.merged);
+}
+
+void drawtilerect(Renderer & r, int x, int y, int w, int h)
+{
+    if (r.backend == BACKEND_SDL) {
+        SDL_Rect rect;
+        rect.x = x;
+        rect.y = y;
+        rect.w = w;
+        rect.h = h;
+        CHECK_SDL(SDL_RenderFillRect(ren, &rect));
+    } else {
+        int x1 = std::max(x, 0);
+        int y1 = std::max(y, 0);
+        int x2 = std::min(x + w, r.cols);
+        int y2 = std::min(y + h, r.rows);
+        FR(ren_y, y1, y2) {
+            if (r.indexed) std::fill(r.index_row(ren_y) + x1, r.index_row(ren_y) + std::max(x1, x2), r.draw_index);
+            else std::fill(r.pixel_row(ren_y) + x1, r.pixel_row(ren_y) + std::max(x1, x2), r.draw_color);
+        }
+    }
+}
+
+void drawtile(Renderer & r, int x, int y)
+{
+    drawtilerect(r, x, y, 1, 1);
+}
+
+#define ENABLE_SUBPIXEL_TEXTURE_MAPPING 0
+
+// Mip level to draw `tex` at when it's `height` pixels tall: the smallest
+// that still has a texel for every pixel, so distant walls and sprites read
+// few texels and don't alias.
+int mip_for_height(Texture const & tex, int height)
+{
+    int level = 0;
+    while (level+1 < static_cast<int>(tex.mips.size()) && tex.mips[level+1].h >= height) ++level;
+    return level;
+}
+
+// Draw column tex_x (of level 0) of `tex` between view_y1 and view_y2. The
+// software backend samples the mip level that fits the projected height;
+// `light` is the light level for the indexed path.
+void map_texture_column(Renderer & r, Texture & tex, int tex_x, int ren_x, real view_y1, real view_y2, int light = 0)
+{
+    PROFILE_COLUMN_ZONE(ZONE_TEXTURE_COLUMN);
+    double tile_per_view = r.tile_per_view();
+    double ren_y1 = r.rows/2 + to_double(view_y1)*tile_per_view;
+    double ren_y2 = r.rows/2 + to_double(view_y2)*tile_per_view;
+
+    int texH = tex.h;
+
+    int ren_y1_int = round_to_int(ren_y1);
+    int ren_y2_int = round_to_int(ren_y2);
+
+    if (r.backend == BACKEND_SOFTWARE) {
+        if (ren_y2_int <= ren_y1_int) return;
+        MipLevel const & mip = tex.mips[mip_for_height(tex, ren_y2_int - ren_y1_int)];
+        int mip_x = tex_x * mip.w / tex.w;
+        texH = mip.h;
+
+        // nearest-neighbour stretch of the whole column onto
+        // [ren_y1_int, ren_y2_int)
+        double tex_step = static_cast<double>(texH) / (static_cast<double>(ren_y2_int) - ren_y1_int);
+        int y1 = std::max(ren_y1_int, 0);
+        int y2 = std::min(ren_y2_int, r.rows);
+        double tex_pos = (static_cast<double>(y1) - ren_y1_int + 0.5) * tex_step;
+
+        if (r.indexed) {
+            Uint8 const * column = mip.index_column(mip_x);
+            Uint8 const * shade = palette->colormap[light];
+            FR(ren_y, y1, y2) {
+                int tex_y = std::min(static_cast<int>(tex_pos), texH-1);
+                Uint8 index = column[tex_y];
+                if (index != INDEX_TRANSPARENT) r.index_row(ren_y)[ren_x] = shade[index];
+                tex_pos += tex_step;
+            }
+            return;
+        }
+
+        Uint32 const * column = mip.column(mip_x);
+        FR(ren_y, y1, y2) {
+            int tex_y = std::min(static_cast<int>(tex_pos), texH-1);
+            Uint32 texel = column[tex_y];
+            if (texel_opaque(texel)) r.pixel_row(ren_y)[ren_x] = texel;
+            tex_pos += tex_step;
+        }
+    } else if (ENABLE_SUBPIXEL_TEXTURE_MAPPING) {
+        if (ren_y1_int < 0) ren_y1_int = 0;
+        if (ren_y2_int >= r.rows) ren_y2_int = r.rows;
+
+        FR(ren_y, ren_y1_int, ren_y2_int) {
+            double tex_y_norm = (ren_y + 0.5 - ren_y1) / (ren_y2 - ren_y1);
+            int tex_y = static_cast<int>(tex_y_norm * texH);
+            if (tex_y >= texH) tex_y = texH;
+
+            SDL_Rect srcrect = { tex_x, tex_y, 1, 1 };
+            SDL_Rect dstrect = { ren_x, ren_y, 1, 1 };
+            CHECK_SDL(SDL_RenderCopy(ren, tex.sdl.get(), &srcrect, &dstrect));
+        }
+    } else {
+        SDL_Rect srcrect = { tex_x, 0, 1, texH };
+        SDL_Rect dstrect = { ren_x, ren_y1_int, 1, ren_y2_int-ren_y1_int };
+        CHECK_SDL(SDL_RenderCopy(ren, tex.sdl.get(), &srcrect, &dstrect));
+    }
+}
+
+// Sprites
+// The software backend draws sprites nearest first. Renderer::sprite_next[x]
+// is a path-compressed "next free row" table for column x: following it from
+// y reaches the first row at or below y that no nearer sprite has covered, so
+// occluded pixels are skipped rather than overdrawn. Columns are reset
+// lazily, the first time a frame touches them.
+Uint16 * sprite_cover_column(Renderer & r, int x)
+{
+    Uint16 * next = r.sprite_next[x];
+    if (r.sprite_next_frame[x] != r.sprite_frame) {
+        FOR(y, r.rows+1) next[y] = y;
+        r.sprite_next_frame[x] = r.sprite_frame;
+    }
+    return next;
+}
+
+int uncovered_row(Uint16 * next, int y)
+{
+    while (next[y] != y) {
+        next[y] = next[next[y]];
+        y = next[y];
+    }
+    return y;
+}
+
+// A sprite column stretched nearest-neighbour onto rows [ren_y1, ren_y2).
+struct SpriteColumn
+{
+    int ren_y1;
+    int ren_y2;
+    int tex_h;
+    double tex_step;
+
+    SpriteColumn(int ren_y1, int ren_y2, int tex_h)
+        : ren_y1(ren_y1), ren_y2(ren_y2), tex_h(tex_h),
+          tex_step(static_cast<double>(tex_h) / (static_cast<double>(ren_y2) - ren_y1)) {}
+
+    int tex_row(int ren_y) const
+    {
+        return std::min(static_cast<int>((static_cast<double>(ren_y) - ren_y1 + 0.5) * tex_step), tex_h-1);
+    }
+
+    // first row whose texel is at or past tex_y
+    int first_row(int tex_y) const
+    {
+        if (tex_y <= 0) return ren_y1;
+        if (tex_y >= tex_h) return ren_y2;
+        int y = ren_y1 + static_cast<int>(ceil(tex_y / tex_step - 0.5));
+        y = std::max(ren_y1, std::min(y, ren_y2));
+        while (y > ren_y1 && tex_row(y-1) >= tex_y) --y;
+        while (y < ren_y2 && tex_row(y) < tex_y) ++y;
+        return y;
+    }
+};
+
+// Draw the uncovered opaque texels of one sprite column into the framebuffer
+// and mark them covered. The cost is the visible pixels plus one lookup per
+// opaque run. `light` is the light level for the indexed path.
+void draw_sprite_column(Renderer & r, MipLevel const & tex, int tex_x, int ren_x, SpriteColumn const & span, int light)
+{
+    int y1 = std::max(span.ren_y1, 0);
+    int y2 = std::min(span.ren_y2, r.rows);
+    Uint16 * next = sprite_cover_column(r, ren_x);
+    if (uncovered_row(next, y1) >= y2) return;
+
+    Uint32 const * column = tex.column(tex_x);
+    Uint8 const * index_column = tex.index_column(tex_x);
+    Uint8 const * shade = palette->colormap[light];
+    for (TexelRun const * run = tex.runs_begin(tex_x); run != tex.runs_end(tex_x); ++run) {
+        int a = std::min(std::max(span.first_row(run->y1), y1), y2);
+        int b = std::min(span.first_row(run->y2), y2);
+        for (int y = uncovered_row(next, a); y < b; y = uncovered_row(next, y+1)) {
+            if (r.indexed) r.index_row(y)[ren_x] = shade[index_column[span.tex_row(y)]];
+            else r.pixel_row(y)[ren_x] = column[span.tex_row(y)];
+            next[y] = y+1;
+        }
+    }
+}
+
+// Which face of a wall cell a ray hit, named by the direction the face points:
+// a ray travelling towards +x hits a west-facing face.
+enum Face { FACE_NONE, FACE_WEST, FACE_NORTH, FACE_EAST, FACE_SOUTH };
+
+struct RayHit
+{
+    real x, y; // hit point in world coordinates
+    real t;    // ray parameter at the hit
+    Face face;
+    int material;
+    real tex_u; // where along the face it hit, from 0 to 1
+};
+
+// Fill in the hit point and texture coordinate of a ray that hit `face` of
+// cell (cx, cy) at ray parameter t.
+void finish_hit(real ox, real oy, real rdx, real rdy, int cx, int cy, real t, Face face, int material, RayHit & hit)
+{
+    hit.t = t;
+    hit.face = face;
+    hit.material = material;
+    if (face == FACE_WEST || face == FACE_EAST) {
+        hit.x = real(cx + (face == FACE_EAST));
+        hit.y = oy + t*rdy;
+        hit.tex_u = hit.y - real(cy);
+    } else {
+        hit.x = ox + t*rdx;
+        hit.y = real(cy + (face == FACE_SOUTH));
+        hit.tex_u = hit.x - real(cx);
+    }
+}
+
+// Test a ray against the part of mover m's box inside cell (cx, cy), which
+// the ray has reached. A ray starting inside the box doesn't hit it.
+bool hit_mover(Mover const & m, real ox, real oy, real rdx, real rdy, int cx, int cy, RayHit & hit)
+{
+    const real INF = real_inf();
+    const real zero = 0;
+
+    real x1 = std::max(m.x1, real(cx)), x2 = std::min(m.x2, real(cx + 1));
+    real y1 = std::max(m.y1, real(cy)), y2 = std::min(m.y2, real(cy + 1));
+    if (x2 < x1 || y2 < y1 || (x1 == x2 && y1 == y2)) return false;
+
+    real tx_near = -INF, tx_far = INF;
+    if (rdx != zero) {
+        real ta = (x1 - ox) / rdx, tb = (x2 - ox) / rdx;
+        tx_near = std::min(ta, tb), tx_far = std::max(ta, tb);
+    } else if (ox < x1 || x2 < ox) {
+        return false;
+    }
+    real ty_near = -INF, ty_far = INF;
+    if (rdy != zero) {
+        real ta = (y1 - oy) / rdy, tb = (y2 - oy) / rdy;
+        ty_near = std::min(ta, tb), ty_far = std::max(ta, tb);
+    } else if (oy < y1 || y2 < oy) {
+        return false;
+    }
+    real t = std::max(tx_near, ty_near);
+    if (t < zero || std::min(tx_far, ty_far) < t) return false;
+
+    hit.t = t;
+    hit.material = level_cell(cx, cy);
+    if (tx_near > ty_near) {
+        hit.face = rdx > zero ? FACE_WEST : FACE_EAST;
+        hit.x = rdx > zero ? x1 : x2;
+        hit.y = oy + t*rdy;
+        hit.tex_u = hit.y - m.y1;
+    } else {
+        hit.face = rdy > zero ? FACE_NORTH : FACE_SOUTH;
+        hit.x = ox + t*rdx;
+        hit.y = rdy > zero ? y1 : y2;
+        hit.tex_u = hit.x - m.x1;
+    }
+    return true;
+}
+
+// Move a ray out of the empty square of cells within dist-1 of (cx, cy), to
+// the cell it enters next, as if it had stepped through them one by one.
+inline void skip_empty(real ox, real oy, real rdx, real rdy, int step_x, int step_y, int dist,
+    int & cx, int & cy, real & t, real & t_max_x, real & t_max_y, Face & face)
+{
+    const real INF = real_inf();
+    const real zero = 0;
+
+    int r = dist - 1;
+    int x1 = cx - r, x2 = cx + r;
+    int y1 = cy - r, y2 = cy + r;
+    real tx = rdx != zero ? (real(step_x > 0 ? x2 + 1 : x1) - ox) / rdx : INF;
+    real ty = rdy != zero ? (real(step_y > 0 ? y2 + 1 : y1) - oy) / rdy : INF;
+    if (tx < ty) {
+        t = tx;
+        cx = step_x > 0 ? x2 + 1 : x1 - 1;
+        cy = std::max(y1, std::min(floor_to_int(oy + t*rdy), y2));
+        face = step_x > 0 ? FACE_WEST : FACE_EAST;
+    } else {
+        t = ty;
+        cy = step_y > 0 ? y2 + 1 : y1 - 1;
+        cx = std::max(x1, std::min(floor_to_int(ox + t*rdx), x2));
+        face = step_y > 0 ? FACE_NORTH : FACE_SOUTH;
+    }
+    t_max_x = rdx != zero ? (real(cx + (step_x > 0)) - ox) / rdx : INF;
+    t_max_y = rdy != zero ? (real(cy + (step_y > 0)) - oy) / rdy : INF;
+}
+
+// Amanatides-Woo traversal of the level from (ox, oy) along (rdx, rdy),
+// stopping at the first solid cell, and jumping over empty space using the
+// distance field, and through the parts of door and pushwall cells their
+// movers don't cover. The cell containing the origin is only tested for a
+// mover; an origin outside the map is first advanced to where the ray enters
+// it. Returns false if the ray leaves the map, reaches a chunk that isn't
+// resident, or gets past ray parameter max_t, without hitting anything.
+bool cast_ray(real ox, real oy, real rdx, real rdy, RayHit & hit, real max_t = real_inf())
+{
+    const real INF = real_inf();
+    const real zero = 0;
+    const real one = 1;
+
+    int step_x = rdx > zero ? 1 : -1;
+    int step_y = rdy > zero ? 1 : -1;
+    real t_delta_x = rdx != zero ? real_abs(one / rdx) : INF;
+    real t_delta_y = rdy != zero ? real_abs(one / rdy) : INF;
+
+    int cx = floor_to_int(ox);
+    int cy = floor_to_int(oy);
+    real t = 0;
+    Face face = FACE_NONE;
+
+    const int map_w = level.width;
+    const int map_h = level.height;
+
+    bool inside = 0 <= cx && cx < map_w && 0 <= cy && cy < map_h;
+    if (!inside) {
+        // clip the ray against the map bounds
+        bool in_x = zero <= ox && ox < real(map_w);
+        bool in_y = zero <= oy && oy < real(map_h);
+        real tx1 = rdx != zero ? (zero - ox) / rdx : (in_x ? -INF : INF);
+        real tx2 = rdx != zero ? (real(map_w) - ox) / rdx : (in_x ? INF : -INF);
+        real ty1 = rdy != zero ? (zero - oy) / rdy : (in_y ? -INF : INF);
+        real ty2 = rdy != zero ? (real(map_h) - oy) / rdy : (in_y ? INF : -INF);
+        real tx_enter = std::min(tx1, tx2), tx_exit = std::max(tx1, tx2);
+        real ty_enter = std::min(ty1, ty2), ty_exit = std::max(ty1, ty2);
+        real t_enter = std::max(tx_enter, ty_enter);
+        real t_exit = std::min(tx_exit, ty_exit);
+        if (t_enter < zero || t_exit <= t_enter) return false;
+
+        t = t_enter;
+        face = tx_enter > ty_enter ? (step_x > 0 ? FACE_WEST : FACE_EAST) : (step_y > 0 ? FACE_NORTH : FACE_SOUTH);
+        cx = std::max(0, std::min(floor_to_int(ox + t*rdx), map_w-1));
+        cy = std::max(0, std::min(floor_to_int(oy + t*rdy), map_h-1));
+        if (face == FACE_WEST) cx = 0;
+        if (face == FACE_EAST) cx = map_w-1;
+        if (face == FACE_NORTH) cy = 0;
+        if (face == FACE_SOUTH) cy = map_h-1;
+    }
+
+    real t_max_x = rdx != zero ? (real(cx + (step_x > 0)) - ox) / rdx : INF;
+    real t_max_y = rdy != zero ? (real(cy + (step_y > 0)) - oy) / rdy : INF;
+
+    bool skip_cell = inside && level_dist(cx, cy) != DIST_MOVER;
+    int material = CELL_EMPTY;
+    for (;;) {
+        int dist = skip_cell ? 1 : level_dist(cx, cy);
+        skip_cell = false;
+        if (dist == 0) {
+            material = level_cell(cx, cy);
+            break;
+        }
+        if (dist == DIST_MOVER) {
+            if (hit_mover(movers[mover_at(cx, cy)], ox, oy, rdx, rdy, cx, cy, hit)) return true;
+            dist = 1;
+        }
+
+        if (dist > 1) {
+            skip_empty(ox, oy, rdx, rdy, step_x, step_y, dist, cx, cy, t, t_max_x, t_max_y, face);
+        } else if (t_max_x < t_max_y) {
+            cx += step_x;
+            t = t_max_x;
+            t_max_x += t_delta_x;
+            face = step_x > 0 ? FACE_WEST : FACE_EAST;
+        } else {
+            cy += step_y;
+            t = t_max_y;
+            t_max_y += t_delta_y;
+            face = step_y > 0 ? FACE_NORTH : FACE_SOUTH;
+        }
+        if (cx < 0 || map_w <= cx || cy < 0 || map_h <= cy || max_t < t) return false;
+    }
+    if (material == CELL_EMPTY || material == CELL_UNLOADED) return false;
+
+    finish_hit(ox, oy, rdx, rdy, cx, cy, t, face, material, hit);
+    return true;
+}
+
+#if HAVE_RAY_SIMD
+// Vectorized version of cast_ray() for RAY_LANES rays from a common origin,
+// written with GCC vector extensions so it compiles to SSE2/AVX natively and
+// to SIMD128 under emcc -msimd128. The lane count follows the native vector
+// width: 2 doubles or 4 floats for SSE2/SIMD128, twice that with AVX. The
+// lanes step through the grid in lockstep, using the same operations as
+// cast_ray() so that results match; a mask tracks which rays are still
+// travelling. Only the map lookup, and jumps over empty space, are done lane
+// by lane.
+#if defined(__AVX__)
+const int VECTOR_BYTES = 32;
+#else
+const int VECTOR_BYTES = 16;
+#endif
+const int RAY_LANES = VECTOR_BYTES / sizeof(real);
+#if RAYCAST_REAL == REAL_FLOAT
+typedef Sint32 mask_int;
+#else
+typedef Sint64 mask_int;
+#endif
+typedef real vreal __attribute__((vector_size(VECTOR_BYTES)));
+typedef mask_int vmask __attribute__((vector_size(VECTOR_BYTES)));
+
+vreal vsplat(real x)
+{
+    vreal v;
+    FOR(i, RAY_LANES) v[i] = x;
+    return v;
+}
+
+vreal vselect(vmask m, vreal a, vreal b)
+{
+    return (vreal)((m & (vmask)a) | (~m & (vmask)b));
+}
+
+bool vany(vmask m)
+{
+    mask_int r = 0;
+    FOR(i, RAY_LANES) r |= m[i];
+    return r != 0;
+}
+
+void cast_ray_batch(real ox, real oy, vreal rdx, vreal rdy, RayHit * hits, bool * found)
+{
+    int cx0 = floor_to_int(ox);
+    int cy0 = floor_to_int(oy);
+    if (cx0 < 0 || level.width <= cx0 || cy0 < 0 || level.height <= cy0 || level_dist(cx0, cy0) == DIST_MOVER) {
+        // origins outside the map need clipping first, and one in a door
+        // needs testing; not worth vectorizing
+        FOR(i, RAY_LANES) found[i] = cast_ray(ox, oy, rdx[i], rdy[i], hits[i]);
+        return;
+    }
+
+    const vreal INF = vsplat(real_inf());
+    const vreal zero = vsplat(0);
+    const vreal one = vsplat(1);
+    const vmask sign = (vmask)vsplat(-0.0);
+
+    vmask pos_x = rdx > zero;
+    vmask pos_y = rdy > zero;
+    vreal step_x = vselect(pos_x, one, -one);
+    vreal step_y = vselect(pos_y, one, -one);
+    vreal t_delta_x = (vreal)((vmask)(one / rdx) & ~sign);
+    vreal t_delta_y = (vreal)((vmask)(one / rdy) & ~sign);
+    t_delta_x = vselect(rdx != zero, t_delta_x, INF);
+    t_delta_y = vselect(rdy != zero, t_delta_y, INF);
+
+    vreal ox_v = vsplat(ox);
+    vreal oy_v = vsplat(oy);
+    vreal cx = vsplat(cx0);
+    vreal cy = vsplat(cy0);
+    vreal t_max_x = vselect(rdx != zero, (cx + vselect(pos_x, one, zero) - ox_v) / rdx, INF);
+    vreal t_max_y = vselect(rdy != zero, (cy + vselect(pos_y, one, zero) - oy_v) / rdy, INF);
+
+    const vreal map_w = vsplat(level.width);
+    const vreal map_h = vsplat(level.height);
+
+    vmask active = (vmask)(zero == zero);
+    while (vany(active)) {
+        vmask choose_x = t_max_x < t_max_y;
+        cx = vselect(choose_x, cx + step_x, cx);
+        cy = vselect(choose_x, cy, cy + step_y);
+        vreal t = vselect(choose_x, t_max_x, t_max_y);
+        t_max_x = vselect(choose_x, t_max_x + t_delta_x, t_max_x);
+        t_max_y = vselect(choose_x, t_max_y, t_max_y + t_delta_y);
+
+        vmask out = (cx < zero) | (cx >= map_w) | (cy < zero) | (cy >= map_h);
+        FOR(i, RAY_LANES) if (active[i] && out[i]) found[i] = false;
+        active &= ~out;
+
+        FOR(i, RAY_LANES) {
+            if (!active[i]) continue;
+            int cell_x = static_cast<int>(cx[i]);
+            int cell_y = static_cast<int>(cy[i]);
+            Face face = choose_x[i] ? (pos_x[i] ? FACE_WEST : FACE_EAST) : (pos_y[i] ? FACE_NORTH : FACE_SOUTH);
+            real t_i = t[i];
+            int dist = level_dist(cell_x, cell_y);
+            if (dist == 1) continue;
+
+            if (dist > 1) {
+                // jump this lane over empty space, as cast_ray() does
+                real t_max_x_i = t_max_x[i], t_max_y_i = t_max_y[i];
+                int step_x_i = pos_x[i] ? 1 : -1, step_y_i = pos_y[i] ? 1 : -1;
+                bool out_i = false;
+                while (dist > 1) {
+                    skip_empty(ox, oy, rdx[i], rdy[i], step_x_i, step_y_i, dist, cell_x, cell_y, t_i, t_max_x_i, t_max_y_i, face);
+                    out_i = cell_x < 0 || level.width <= cell_x || cell_y < 0 || level.height <= cell_y;
+                    if (out_i) break;
+                    dist = level_dist(cell_x, cell_y);
+                }
+                cx[i] = cell_x;
+                cy[i] = cell_y;
+                t_max_x[i] = t_max_x_i;
+                t_max_y[i] = t_max_y_i;
+                if (out_i) {
+                    found[i] = false;
+                    active[i] = 0;
+                    continue;
+                }
+                if (dist == 1) continue;
+            }
+
+            if (dist == DIST_MOVER) {
+                // through the mover's cell, unless it hits the mover
+                if (!hit_mover(movers[mover_at(cell_x, cell_y)], ox, oy, rdx[i], rdy[i], cell_x, cell_y, hits[i])) continue;
+                found[i] = true;
+                active[i] = 0;
+                continue;
+            }
+            int material = level_cell(cell_x, cell_y);
+            found[i] = material != CELL_EMPTY && material != CELL_UNLOADED;
+            active[i] = 0;
+            if (!found[i]) continue;
+
+            finish_hit(ox, oy, rdx[i], rdy[i], cell_x, cell_y, t_i, face, material, hits[i]);
+        }
+    }
+}
+#endif
+
+// Line of sight and hitscan
+// Queries for game code, on the same traversal the renderer casts rays with:
+// whether one point can see another, and what a shot hits, wall or entity.
+// They only read the world, so run_queries() can spread a batch of them over
+// the pool, as long as nothing moves or streams meanwhile. Chunks that aren't
+// resident don't block them.
+
+// Whether the segment from (x0, y0) to (x1, y1) misses every wall and closed
+// door.
+bool line_of_sight(double x0, double y0, double x1, double y1)
+{
+    RayHit hit;
+    real one = 1;
+    return !cast_ray(real(x0), real(y0), real(x1 - x0), real(y1 - y0), hit, one) || one <= hit.t;
+}
+
+struct ScanHit
+{
+    double t;   // distance to the hit; the range for no hit
+    int entity; // the entity hit, or -1 for a wall or nothing
+    bool wall;
+};
+
+// Distance along the unit ray (dx, dy) from (ox, oy) to where it meets the
+// circle of `radius` round (cx, cy), or -1 if it doesn't, or starts inside.
+double ray_circle(double ox, double oy, double dx, double dy, double cx, double cy, double radius)
+{
+    double ex = cx - ox, ey = cy - oy;
+    double along = ex*dx + ey*dy;
+    double perp2 = ex*ex + ey*ey - along*along;
+    double r2 = radius*radius;
+    if (along < 0 || r2 < perp2) return -1;
+    double t = along - sqrt(r2 - perp2);
+    return t < 0 ? -1 : t;
+}
+
+// The first wall or entity a shot from (x, y) towards `angle` hits within
+// `range`, ignoring entity `ignore` (the shooter, or -1). Entities are
+// circles of their sprite's width, looked for in the entity grid cells along
+// the shot up to the wall it hits, and in the ones beside it that an entity
+// could poke out of into the shot's way.
+ScanHit hitscan(double x, double y, double angle, double range, int ignore = -1)
+{
+    double dx = cos(2*M_PI * angle), dy = sin(2*M_PI * angle);
+    ScanHit out = { range, -1, false };
+    RayHit hit;
+    if (cast_ray(real(x), real(y), real(dx), real(dy), hit, real(range)) && to_double(hit.t) < range) {
+        out.t = to_double(hit.t);
+        out.wall = true;
+    }
+
+    // walk the entity grid cells the shot crosses, in order, stopping once a
+    // cell starts past the nearest hit so far; entities poke out of their
+    // grid cell by up to their radius, so each step looks in every cell
+    // within that of the shot's stretch through the cell
+    Entities const & es = entities;
+    const double cell = double(1 << ENTITY_CELL_BITS);
+    int gx = entity_grid_cell(x), gy = entity_grid_cell(y);
+    int step_x = dx > 0 ? 1 : -1, step_y = dy > 0 ? 1 : -1;
+    double t_delta_x = dx != 0 ? fabs(cell / dx) : HUGE_VAL;
+    double t_delta_y = dy != 0 ? fabs(cell / dy) : HUGE_VAL;
+    double t_max_x = dx != 0 ? ((gx + (step_x > 0)) * cell - x) / dx : HUGE_VAL;
+    double t_max_y = dy != 0 ? ((gy + (step_y > 0)) * cell - y) / dy : HUGE_VAL;
+    const double reach = 0.5 * to_double(es.max_width);
+    double t_cell = 0;
+    while (t_cell <= out.t + reach) {
+        double t_next = std::min(std::min(t_max_x, t_max_y), out.t + reach);
+        double x1 = x + dx*t_cell, y1 = y + dy*t_cell, x2 = x + dx*t_next, y2 = y + dy*t_next;
+        int cx1 = entity_grid_cell(std::min(x1, x2) - reach), cx2 = entity_grid_cell(std::max(x1, x2) + reach);
+        int cy1 = entity_grid_cell(std::min(y1, y2) - reach), cy2 = entity_grid_cell(std::max(y1, y2) + reach);
+        FR(cy, cy1, cy2 + 1) FR(cx, cx1, cx2 + 1) {
+            for (int i = es.bucket_head[entity_bucket(cx, cy)]; i >= 0; i = es.next[i]) {
+                if (i == ignore) continue;
+                double t = ray_circle(x, y, dx, dy, to_double(es.x[i]), to_double(es.y[i]), 0.5 * to_double(es.width[i]));
+                if (0 <= t && t < out.t) {
+                    out.t = t;
+                    out.entity = i;
+                    out.wall = false;
+                }
+            }
+        }
+        if (t_max_x < t_max_y) {
+            t_cell = t_max_x;
+            t_max_x += t_delta_x;
+            gx += step_x;
+        } else {
+            t_cell = t_max_y;
+            t_max_y += t_delta_y;
+            gy += step_y;
+        }
+    }
+    return out;
+}
+
+struct SightQuery
+{
+    double x0, y0, x1, y1;
+    bool clear; // result
+};
+
+struct ScanQuery
+{
+    double x, y, angle, range;
+    int ignore;
+    ScanHit hit; // result
+};
+
+// Below this many queries, waking the pool costs more than it saves.
+const int MIN_POOL_QUERIES = 256;
+
+// Answer a batch of queries, spread over `pool` if there are enough (or on
+// this thread without one).
+void run_queries(SightQuery * sights, int num_sights, ScanQuery * scans, int num_scans, ThreadPool * pool)
+{
+    struct Job
+    {
+        SightQuery * sights;
+        int num_sights;
+        ScanQuery * scans;
+
+        void run(int i1, int i2) const
+        {
+            FR(i, i1, i2) {
+                if (i < num_sights) {
+                    SightQuery & q = sights[i];
+                    q.clear = line_of_sight(q.x0, q.y0, q.x1, q.y1);
+                } else {
+                    ScanQuery & q = scans[i - num_sights];
+                    q.hit = hitscan(q.x, q.y, q.angle, q.range, q.ignore);
+                }
+            }
+        }
+    } job = { sights, num_sights, scans };
+
+    int n = num_sights + num_scans;
+    if (!pool || n < MIN_POOL_QUERIES) job.run(0, n);
+    else pool->parallel_for(n, [&job](int i1, int i2) { job.run(i1, i2); });
+}
+
+const double AIM_RANGE = 64;
+
+std::vector<SightQuery> sight_queries; // one per entity, towards the player
+int entities_in_sight;
+ScanHit aim; // what the middle of the view points at
+
+bool use_held;
+
+// One fixed simulation step of deltaFrame_s.
+void update()
+{
+    PROFILE_ZONE(ZONE_UPDATE);
+
+    Uint8 const * state = SDL_GetKeyboardState(NULL);
+    if (state[SDL_SCANCODE_S] || state[SDL_SCANCODE_DOWN]) {
+        moveplayer(-PLAYER_MOVE_SPEED);
+    }
+    if (state[SDL_SCANCODE_W] || state[SDL_SCANCODE_UP]) {
+        moveplayer(PLAYER_MOVE_SPEED);
+    }
+    if (state[SDL_SCANCODE_LEFT]) {
+        rotateplayer(-1.0/2.0);
+    }
+    if (state[SDL_SCANCODE_RIGHT]) {
+        rotateplayer(1.0/2.0);
+    }
+    if (state[SDL_SCANCODE_A]) {
+        strafeplayer(-PLAYER_MOVE_SPEED);
+    }
+    if (state[SDL_SCANCODE_D]) {
+        strafeplayer(PLAYER_MOVE_SPEED);
+    }
+
+    // use on the press, not while held
+    bool use = state[SDL_SCANCODE_E] || state[SDL_SCANCODE_SPACE];
+    if (use && !use_held) use_mover();
+    use_held = use;
+
+    update_movers(deltaFrame_s);
+
+    //// what the player can see and is aiming at
+    int n = entities.size();
+    sight_queries.resize(n);
+    FOR(i, n) {
+        SightQuery q = { to_double(entities.x[i]), to_double(entities.y[i]), player_x, player_y, false };
+        sight_queries[i] = q;
+    }
+    ScanQuery aim_query = { player_x, player_y, player_angle, AIM_RANGE, -1, ScanHit() };
+    run_queries(sight_queries.data(), n, &aim_query, 1, &render_pool);
+    entities_in_sight = 0;
+    FOR(i, n) entities_in_sight += sight_queries[i].clear;
+    aim = aim_query.hit;
+}
+
+// Wall textures by material, for faces of colour 1 (east/west) and 2
+// (north/south). Materials past the end of the table wrap around.
+struct WallTextures
+{
+    Texture * color1;
+    Texture * color2;
+};
+const WallTextures wall_textures[] = {
+    { &red_2panel, &green_2panel },
+    { &red_brick, &green_brick },
+    { &red_panel, &green_panel },
+};
+const int NUM_WALL_TEXTURES = sizeof(wall_textures) / sizeof(wall_textures[0]);
+
+const real MIN_WALL_DIST = real(1) / real(64);
+
+void draw_wall_column(Renderer & r, int screen_col)
+{
+    ColumnHit const & col = r.column_hits[screen_col];
+    if (col.dist == real(0)) return;
+
+    // a camera right up against a wall would make the column absurdly tall
+    real viewport_unit_per_wall_unit = real(1) / std::max(col.dist, MIN_WALL_DIST);
+
+    real wall_viewport_height = viewport_unit_per_wall_unit;
+
+    real view_y1 = -wall_viewport_height/real(2);
+    real view_y2 = wall_viewport_height/real(2);
+
+    WallTextures const & textures = wall_textures[(col.material - 1) % NUM_WALL_TEXTURES];
+    Texture * tex = NULL;
+    if (col.color == 2) {
+        tex = textures.color2;
+    } else {
+        tex = textures.color1;
+    }
+
+    int tex_x = std::max(0, std::min(floor_to_int(real(tex->w) * col.tex_u), tex->w-1));
+    map_texture_column(r, *tex, tex_x, screen_col, view_y1, view_y2, light_level(to_double(col.dist)));
+}
+
+void draw_wall_columns(Renderer & r, int col1, int col2)
+{
+    PROFILE_ZONE(ZONE_DRAW_WALLS);
+    FR(col, col1, col2) draw_wall_column(r, col);
+}
+
+// Floor and ceiling
+// Both are planes half a wall below and above the eye, so every pixel of a
+// screen row sees them at one depth: a floor row and its mirrored ceiling row
+// compute that depth once, pick a mip level for it, and step 16.16 texture
+// coordinates linearly across the row. Plane textures must be a power of two
+// on a side so the coordinates can wrap by masking.
+struct PlaneRow
+{
+    double x0, y0;       // world position under column 0
+    double step_x, step_y; // world step per column
+    double footprint;    // world size of one pixel
+    int light;           // light level, for the indexed path
+};
+
+PlaneRow plane_row(Renderer & r, int ren_y)
+{
+    double tile_per_view = r.tile_per_view();
+    double view_y = (ren_y + 0.5 - r.rows/2) / tile_per_view;
+    double z = 0.5 / std::fabs(view_y);
+    double dir_x = to_double(r.camera.dx);
+    double dir_y = to_double(r.camera.dy);
+    double tan0 = to_double(r.ray_table.col_tan[0]);
+    double dtan = 2.0 * r.screen_tan_max / (r.cols-1);
+
+    PlaneRow row;
+    row.x0 = to_double(r.camera.x) + z * (dir_x - dir_y * tan0);
+    row.y0 = to_double(r.camera.y) + z * (dir_y + dir_x * tan0);
+    row.step_x = -z * dir_y * dtan;
+    row.step_y = z * dir_x * dtan;
+    // across the row a pixel spans z*dtan, between rows 2*z times that; use
+    // the side of a square of the same area
+    row.footprint = z * dtan * std::sqrt(2*z);
+    row.light = light_level(z);
+    return row;
+}
+
+void draw_plane_row(Renderer & r, Texture const & tex, PlaneRow const & row, int ren_y)
+{
+    int level = 0;
+    while (level+1 < static_cast<int>(tex.mips.size()) && row.footprint * tex.mips[level].w > 1) ++level;
+    MipLevel const & mip = tex.mips[level];
+
+    // coordinates in texels, wrapped into the texture before going fixed point
+    double u0 = row.x0 * mip.w;
+    double v0 = row.y0 * mip.h;
+    u0 -= floor(u0 / mip.w) * mip.w;
+    v0 -= floor(v0 / mip.h) * mip.h;
+    Uint32 u = static_cast<Uint32>(u0 * 65536);
+    Uint32 v = static_cast<Uint32>(v0 * 65536);
+    Uint32 du = static_cast<Uint32>(static_cast<Sint32>(floor(row.step_x * mip.w * 65536 + 0.5)));
+    Uint32 dv = static_cast<Uint32>(static_cast<Sint32>(floor(row.step_y * mip.h * 65536 + 0.5)));
+
+    Uint32 mask_u = mip.w - 1;
+    Uint32 mask_v = mip.h - 1;
+    int h = mip.h;
+    if (r.indexed) {
+        Uint8 const * indices = mip.indices;
+        Uint8 const * shade = palette->colormap[row.light];
+        Uint8 * out = r.index_row(ren_y);
+        FOR(x, r.cols) {
+            out[x] = shade[indices[((u >> 16) & mask_u) * h + ((v >> 16) & mask_v)]];
+            u += du;
+            v += dv;
+        }
+        return;
+    }
+
+    Uint32 const * texels = mip.columns;
+    Uint32 * out = r.pixel_row(ren_y);
+    FOR(x, r.cols) {
+        out[x] = texels[((u >> 16) & mask_u) * h + ((v >> 16) & mask_v)];
+        u += du;
+        v += dv;
+    }
+}
+
+// Rows [row1, row2) of the floor, each with its mirrored ceiling row.
+void draw_plane_rows(Renderer & r, int row1, int row2)
+{
+    FR(ren_y, row1, row2) {
+        PlaneRow row = plane_row(r, ren_y);
+        draw_plane_row(r, floor_texture, row, ren_y);
+        draw_plane_row(r, ceiling_texture, row, r.rows-1 - ren_y);
+    }
+}
+
+void store_column(Renderer & r, int screen_col, bool found, RayHit const & hit)
+{
+    ColumnHit & col = r.column_hits[screen_col];
+    col.x = 0;
+    col.y = 0;
+    col.dist = 0;
+    col.color = 0;
+    col.material = 0;
+    col.tex_u = 0;
+
+    if (found) {
+        col.x = hit.x;
+        col.y = hit.y;
+        col.dist = hit.t;
+        col.color = (hit.face == FACE_WEST || hit.face == FACE_EAST) ? 1 : 2;
+        col.material = hit.material;
+        col.tex_u = hit.tex_u;
+    }
+
+    r.column_dist[screen_col] = col.dist;
+}
+
+// Casts the rays for columns [col1, col2). Only touches those columns of
+// column_dist and column_hits, so disjoint bands can run on different threads.
+//
+// The ray direction is the view direction plus an offset along the camera
+// plane, so the ray parameter at the hit is already the distance along the
+// view direction.
+void cast_columns(Renderer & r, int col1, int col2)
+{
+    PROFILE_ZONE(ZONE_CAST_COLUMNS);
+    int screen_col = col1;
+
+#if HAVE_RAY_SIMD
+    if (ray_kernel == KERNEL_SIMD) {
+        vreal pdx = vsplat(r.camera.dx);
+        vreal pdy = vsplat(r.camera.dy);
+        for (; screen_col + RAY_LANES <= col2; screen_col += RAY_LANES) {
+            vreal col_tan;
+            std::memcpy(&col_tan, &r.ray_table.col_tan[screen_col], sizeof(col_tan));
+
+            RayHit hits[RAY_LANES];
+            bool found[RAY_LANES];
+            cast_ray_batch(r.camera.x, r.camera.y, pdx - pdy * col_tan, pdy + pdx * col_tan, hits, found);
+            FOR(i, RAY_LANES) store_column(r, screen_col + i, found[i], hits[i]);
+        }
+    }
+#endif
+
+    for (; screen_col < col2; ++screen_col) {
+        real col_tan = r.ray_table.col_tan[screen_col];
+        real ray_dx = real(r.camera.dx) - real(r.camera.dy) * col_tan;
+        real ray_dy = real(r.camera.dy) + real(r.camera.dx) * col_tan;
+
+        RayHit hit;
+        bool found = cast_ray(r.camera.x, r.camera.y, ray_dx, ray_dy, hit);
+        store_column(r, screen_col, found, hit);
+    }
+}
+
+// Column reuse
+// A column's hit depends only on the camera position, its ray's direction
+// and the level, so a frame cast from the same camera and level as the last
+// one reuses every column and casts no rays. With Renderer::reproject, a frame
+// that has only turned also gives each column the last frame's ray pointing
+// within REPROJECT_TOLERANCE of a column's width of its own, if there is one,
+// and casts the rest: the hit point stays put and only its distance along
+// the new view direction is redone. Reused rays keep their true direction,
+// so the error doesn't build up while turning. Any move recasts everything.
+const double REPROJECT_TOLERANCE = 0.25;
+
+// a - b, wrapped to [-pi, pi)
+double angle_diff(double a, double b)
+{
+    double d = std::fmod(a - b + M_PI, 2*M_PI);
+    if (d < 0) d += 2*M_PI;
+    return d - M_PI;
+}
+
+// Fills in what columns it can from the last frame and marks the rest in
+// column_stale. Returns how many are stale.
+int reuse_columns(Renderer & r)
+{
+    ColumnCache const & cache = r.column_cache;
+    bool same_origin = cache.valid && cache.cols == r.cols && cache.fov == r.ray_table.fov &&
+        cache.revision == level.revision && cache.kernel == ray_kernel &&
+        cache.camera.x == r.camera.x && cache.camera.y == r.camera.y;
+
+    if (same_origin && cache.camera.angle == r.camera.angle) {
+        std::fill(r.column_stale, r.column_stale + r.cols, false);
+        return 0;
+    }
+    std::fill(r.column_stale, r.column_stale + r.cols, true);
+    if (!same_origin || !r.reproject) return r.cols;
+
+    double dtan = 2.0 * r.ray_table.screen_tan_max / (r.cols-1);
+    double turn = angle_diff(2*M_PI * r.camera.angle, 2*M_PI * cache.camera.angle);
+    int stale = 0;
+    FOR(screen_col, r.cols) {
+        double col_angle = atan(to_double(r.ray_table.col_tan[screen_col]));
+        double ray_angle = 2*M_PI * r.camera.angle + col_angle;
+
+        // the last frame's column nearest this ray, if it was on screen
+        double old_angle = col_angle + turn;
+        int old_col = -1;
+        if (std::fabs(old_angle) < M_PI/2) old_col = round_to_int((tan(old_angle) + r.ray_table.screen_tan_max) / dtan);
+
+        if (0 <= old_col && old_col < r.cols) {
+            double old_tan = to_double(r.ray_table.col_tan[old_col]);
+            double col_width = dtan / (1 + old_tan*old_tan);
+            ColumnHit col = cache.hits[old_col];
+            if (col.dist != 0) col.dist = (col.x - real(r.camera.x)) * real(r.camera.dx) + (col.y - real(r.camera.y)) * real(r.camera.dy);
+            if (std::fabs(angle_diff(cache.ray_angle[old_col], ray_angle)) <= REPROJECT_TOLERANCE * col_width &&
+                col.dist >= 0) {
+                r.column_hits[screen_col] = col;
+                r.column_dist[screen_col] = col.dist;
+                r.column_ray_angle[screen_col] = cache.ray_angle[old_col];
+                r.column_stale[screen_col] = false;
+                continue;
+            }
+        }
+        ++stale;
+    }
+    return stale;
+}
+
+// Casts the stale columns of [col1, col2), in runs.
+void cast_stale_columns(Renderer & r, int col1, int col2)
+{
+    int screen_col = col1;
+    while (screen_col < col2) {
+        while (screen_col < col2 && !r.column_stale[screen_col]) ++screen_col;
+        int run = screen_col;
+        while (screen_col < col2 && r.column_stale[screen_col]) ++screen_col;
+        if (run < screen_col) cast_columns(r, run, screen_col);
+    }
+}
+
+// Keeps this frame's columns for the next one.
+void save_columns(Renderer & r)
+{
+    ColumnCache & cache = r.column_cache;
+    FOR(screen_col, r.cols) {
+        if (r.column_stale[screen_col]) {
+            r.column_ray_angle[screen_col] = 2*M_PI * r.camera.angle + atan(to_double(r.ray_table.col_tan[screen_col]));
+        }
+    }
+    cache.valid = true;
+    cache.camera = r.camera;
+    cache.cols = r.cols;
+    cache.fov = r.ray_table.fov;
+    cache.revision = level.revision;
+    cache.kernel = ray_kernel;
+    std::copy(r.column_hits, r.column_hits + r.cols, cache.hits);
+    std::copy(r.column_ray_angle, r.column_ray_angle + r.cols, cache.ray_angle);
+}
+
+// Minimap
+// The level part of the minimap only changes when its window over the level
+// moves or the resident cells change, so it's kept as an image (and, for the
+// SDL backend, a texture) that's rebuilt only then. Single cells that change,
+// like edits and doors opening, are repainted on their own, and only the
+// rectangle around them is uploaded. Markers go on top of it each frame.
+struct MinimapCache
+{
+    bool valid;
+    int x0, y0;
+    unsigned resident_revision;
+    SDL_Rect stale; // pixels changed since minimap_tex was updated; w == 0 for none
+    Uint32 pixels[MINIMAP_SIZE][MINIMAP_SIZE];
+    Uint8 indices[MINIMAP_SIZE][MINIMAP_SIZE]; // the same, as palette indices
+};
+MinimapCache minimap;
+
+enum { MINIMAP_EMPTY, MINIMAP_SOLID, MINIMAP_UNLOADED };
+
+// Repaint minimap pixel (x, y) from its cell, in colors[] (and the palette
+// entries indices[]). An open door shows as empty.
+void paint_minimap_cell(int x, int y, Uint32 const * colors, Uint8 const * indices)
+{
+    int cx = minimap.x0 + x, cy = minimap.y0 + y;
+    int material = level_cell(cx, cy);
+    int shade = MINIMAP_EMPTY;
+    if (material == CELL_UNLOADED) {
+        shade = MINIMAP_UNLOADED;
+    } else if (material != CELL_EMPTY) {
+        int m = mover_at(cx, cy);
+        if (m < 0 || !door_open(movers[m])) shade = MINIMAP_SOLID;
+    }
+    minimap.pixels[y][x] = colors[shade];
+    minimap.indices[y][x] = indices[shade];
+}
+
+void mark_minimap_stale(int x1, int y1, int x2, int y2)
+{
+    SDL_Rect & r = minimap.stale;
+    if (r.w > 0) {
+        x1 = std::min(x1, r.x), y1 = std::min(y1, r.y);
+        x2 = std::max(x2, r.x + r.w), y2 = std::max(y2, r.y + r.h);
+    }
+    r.x = x1, r.y = y1, r.w = x2 - x1, r.h = y2 - y1;
+}
+
+void update_minimap(int x0, int y0)
+{
+    bool rebuild = !minimap.valid || minimap.x0 != x0 || minimap.y0 != y0 ||
+        minimap.resident_revision != level.resident_revision || level.changed_cells_lost;
+    if (!rebuild && level.changed_cells.empty()) return;
+
+    Uint32 colors[3] = { rgba8888(0, 0, 0, 255), rgba8888(255, 255, 255, 255), rgba8888(64, 64, 64, 255) };
+    Uint8 indices[3];
+    FOR(i, 3) indices[i] = nearest_index(colors[i]);
+    if (rebuild) {
+        minimap.valid = true;
+        minimap.x0 = x0;
+        minimap.y0 = y0;
+        minimap.resident_revision = level.resident_revision;
+        FOR(y, MINIMAP_SIZE) FOR(x, MINIMAP_SIZE) paint_minimap_cell(x, y, colors, indices);
+        mark_minimap_stale(0, 0, MINIMAP_SIZE, MINIMAP_SIZE);
+    } else {
+        FOR(i, int(level.changed_cells.size())) {
+            int x = level.changed_cells[i].first - x0, y = level.changed_cells[i].second - y0;
+            if (x < 0 || MINIMAP_SIZE <= x || y < 0 || MINIMAP_SIZE <= y) continue;
+            paint_minimap_cell(x, y, colors, indices);
+            mark_minimap_stale(x, y, x + 1, y + 1);
+        }
+    }
+    level.changed_cells.clear();
+    level.changed_cells_lost = false;
+}
+
+// Copy the top-left w x h cells of the cached minimap to the top right corner.
+void draw_minimap(Renderer & r, int w, int h)
+{
+    int x0 = r.cols - MINIMAP_SIZE;
+    if (r.backend == BACKEND_SOFTWARE) {
+        if (r.indexed) FOR(y, h) std::copy(minimap.indices[y], minimap.indices[y] + w, r.index_row(y) + x0);
+        else FOR(y, h) std::copy(minimap.pixels[y], minimap.pixels[y] + w, r.pixel_row(y) + x0);
+        return;
+    }
+
+    SDL_Rect & stale = minimap.stale;
+    if (stale.w > 0) {
+        CHECK_SDL(SDL_UpdateTexture(minimap_tex.get(), &stale, &minimap.pixels[stale.y][stale.x], sizeof(minimap.pixels[0])));
+        stale.w = 0;
+    }
+    SDL_Rect src = { 0, 0, w, h };
+    SDL_Rect dst = { x0, 0, w, h };
+    CHECK_SDL(SDL_RenderCopy(ren, minimap_tex.get(), &src, &dst));
+}
+
+// HUD
+// The text lines are drawn into a transparent window-wide layer, redrawn only
+// when the formatted text changes, and composited over the scaled-up frame
+// with one copy.
+const int HUD_TEXT_LEN = 256;
+char hud_text[HUD_TEXT_LEN]; // what hud_layer shows
+
+void draw_hud(const char * text)
+{
+    if (strcmp(hud_text, text) != 0) {
+        snprintf(hud_text, sizeof(hud_text), "%s", text);
+        CHECK_SDL(SDL_SetRenderTarget(ren, hud_layer.get()));
+        CHECK_SDL(SDL_SetRenderDrawColor(ren, 0, 0, 0, 0));
+        CHECK_SDL(SDL_RenderClear(ren));
+        DrawText(ren, glyph_atlas, text, {255, 255, 255, 255}, 0, 0, NULL, NULL, false);
+        DrawText(ren, glyph_atlas, "WASD/arrows: move, E/Space: open doors, B: switch backend, I: indexed colour, K: switch ray kernel, F: floor textures, R: reuse rays when turning, V: views, G: frame graph, P: trace, Esc: quit", {255, 255, 255, 255}, 0, glyph_atlas.line_skip, NULL, NULL, false);
+        CHECK_SDL(SDL_SetRenderTarget(ren, NULL));
+    }
+    SDL_Rect dst = { 0, 0, WIN_WIDTH, 2 * glyph_atlas.line_skip };
+    CHECK_SDL(SDL_RenderCopy(ren, hud_layer.get(), NULL, &dst));
+}
+
+// Frame-time histogram of the recent frames, with per-zone bars for the last
+// frame above it, drawn at window resolution. Both share the same ms scale.
+void draw_profile_overlay()
+{
+    const int BUCKETS = 50; // 1 ms each; the last one also counts slower frames
+    int hist[BUCKETS] = { 0 };
+    int most = 1;
+    FOR(i, int(frame_times.held())) {
+        int b = std::min(BUCKETS - 1, std::max(0, int(frame_times.back(i))));
+        most = std::max(most, ++hist[b]);
+    }
+
+    int line = glyph_atlas.line_skip;
+    int px_per_ms = std::max(2, WIN_WIDTH / 3 / BUCKETS);
+    int hist_h = WIN_HEIGHT / 6;
+    int x0 = line / 2;
+    int y0 = WIN_HEIGHT - line / 2; // histogram baseline
+    int zones_h = ENABLE_PROFILER ? ZONE_COUNT * line : 0;
+
+    SDL_Rect panel = { 0, y0 - hist_h - zones_h - line, BUCKETS * px_per_ms + 12 * line, WIN_HEIGHT - (y0 - hist_h - zones_h - line) };
+    CHECK_SDL(SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND));
+    CHECK_SDL(SDL_SetRenderDrawColor(ren, 0, 0, 0, 192));
+    CHECK_SDL(SDL_RenderFillRect(ren, &panel));
+    CHECK_SDL(SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_NONE));
+
+    CHECK_SDL(SDL_SetRenderDrawColor(ren, 255, 255, 255, 255));
+    FOR(b, BUCKETS) {
+        int h = hist[b] * hist_h / most;
+        SDL_Rect bar = { x0 + b * px_per_ms, y0 - h, px_per_ms - 1, h };
+        CHECK_SDL(SDL_RenderFillRect(ren, &bar));
+    }
+
+    // 60 and 30 fps marks
+    CHECK_SDL(SDL_SetRenderDrawColor(ren, 0, 255, 0, 255));
+    CHECK_SDL(SDL_RenderDrawLine(ren, x0 + int(1000.0 / 60 * px_per_ms), y0, x0 + int(1000.0 / 60 * px_per_ms), y0 - hist_h));
+    CHECK_SDL(SDL_SetRenderDrawColor(ren, 255, 0, 0, 255));
+    CHECK_SDL(SDL_RenderDrawLine(ren, x0 + int(1000.0 / 30 * px_per_ms), y0, x0 + int(1000.0 / 30 * px_per_ms), y0 - hist_h));
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "frame time, last %d frames", int(frame_times.held()));
+    DrawText(ren, glyph_atlas, buf, {255, 255, 255, 255}, x0 + BUCKETS * px_per_ms + line / 2, y0 - line, NULL, NULL, false);
+
+    FOR(z, zones_h ? ZONE_COUNT : 0) {
+        int y = y0 - hist_h - zones_h + z * line;
+        SDL_Rect bar = { x0, y + line / 4, std::min(BUCKETS * px_per_ms, int(zone_ms[z] * px_per_ms) + 1), line / 2 };
+        CHECK_SDL(SDL_SetRenderDrawColor(ren, 255, 192, 0, 255));
+        CHECK_SDL(SDL_RenderFillRect(ren, &bar));
+        snprintf(buf, sizeof(buf), "%s %.2f ms", zone_names[z], zone_ms[z]);
+        DrawText(ren, glyph_atlas, buf, {255, 255, 255, 255}, x0 + BUCKETS * px_per_ms + line / 2, y, NULL, NULL, false);
+    }
+}
+
+// A drawn frame on its way to the screen. The software backend draws into
+// `pixels`, or `indices` when indexed; the SDL backend draws into
+// pixel_screen and only uses the rest.
+struct FrameSlot
+{
+    Uint32 pixels[TILE_ROWS][TILE_COLS];
+    Uint8 indices[TILE_ROWS][TILE_COLS];
+    int cols, rows; // the part of pixels (or pixel_screen) drawn
+    RenderBackend backend;
+    bool indexed;
+    Camera camera;
+    ColumnHit straight; // the centre column's hit, for the HUD
+    int columns_cast;   // rays cast for it, the rest were reused
+    Uint64 input_time;  // when the input this frame shows was read
+};
+FrameSlot frame_slots[2];
+
+// Floor rows nearer the horizon than the shortest wall are hidden everywhere.
+void find_first_plane_row(Renderer & r)
+{
+    real min_half_height = real_inf();
+    FOR(x, r.cols) {
+        real dist = r.column_hits[x].dist;
+        min_half_height = std::min(min_half_height, dist == real(0) ? real(0) : real(1) / (dist * real(2)));
+    }
+    double tile_per_view = r.tile_per_view();
+    r.first_plane_row = std::max(r.rows/2, static_cast<int>(floor(r.rows/2 + std::min(to_double(min_half_height)*tile_per_view, double(r.rows - r.rows/2)))));
+}
+
+// Columns [x1, x2) of a sprite with no nearer wall.
+struct ColumnSpan
+{
+    int x1, x2;
+};
+
+// Find and draw the sprites r can see, once its walls are drawn.
+void draw_sprites(Renderer & r)
+{
+    // nothing nearer than the farthest wall hit can show
+    real far = 0;
+    FOR(x, r.cols) far = std::max(far, r.column_dist[x]);
+    collect_visible_entities(r, to_double(far));
+
+    // Sprites are drawn over the column spans where no wall is nearer, found
+    // before anything is emitted so hidden sprites cost almost nothing. The
+    // software backend goes nearest first and never overdraws; the SDL
+    // backend paints far to near.
+    ++r.sprite_frame;
+    bool front_to_back = r.backend == BACKEND_SOFTWARE;
+    int num_visible = r.entities.visible.size();
+    ColumnSpan * spans = r.arena.alloc<ColumnSpan>(r.cols/2 + 1); // spans are a column apart at least
+    FOR(k, num_visible) {
+        int i = r.entities.visible[front_to_back ? num_visible-1 - k : k];
+        Vector3D const & scene = r.entities.scene[i];
+        Texture & sprite = *entities.sprite[i];
+        SceneRect ent_rect_scene;
+        ent_rect_scene.z = scene.z;
+        ent_rect_scene.x = scene.x - entities.width[i]/real(2);
+        ent_rect_scene.y = scene.y - entities.height[i];
+        ent_rect_scene.w = entities.width[i];
+        ent_rect_scene.h = entities.height[i];
+
+        ViewRect ent_rect_view = scene_to_view(ent_rect_scene);
+        SDL_Rect ent_rect_sdl = view_to_sdl(r, ent_rect_view);
+
+        int x1 = std::max(ent_rect_sdl.x, 0);
+        int x2 = std::min(ent_rect_sdl.x + ent_rect_sdl.w, r.cols);
+        int num_spans = 0;
+        for (int x = x1; x < x2; ) {
+            while (x < x2 && r.column_dist[x] < ent_rect_scene.z) ++x;
+            int span_x1 = x;
+            while (x < x2 && !(r.column_dist[x] < ent_rect_scene.z)) ++x;
+            if (span_x1 < x) {
+                spans[num_spans].x1 = span_x1;
+                spans[num_spans].x2 = x;
+                ++num_spans;
+            }
+        }
+        if (num_spans == 0) continue;
+
+        double tile_per_view = r.tile_per_view();
+        int ren_y1 = round_to_int(r.rows/2 + to_double(ent_rect_view.y)*tile_per_view);
+        int ren_y2 = round_to_int(r.rows/2 + to_double(ent_rect_view.y + ent_rect_view.h)*tile_per_view);
+        MipLevel const & mip = sprite.mips[front_to_back ? mip_for_height(sprite, ren_y2 - ren_y1) : 0];
+        SpriteColumn rows(ren_y1, ren_y2, mip.h);
+        if (front_to_back && (rows.ren_y2 <= std::max(rows.ren_y1, 0) || rows.ren_y1 >= r.rows)) continue;
+        int light = light_level(to_double(ent_rect_scene.z));
+
+        FOR(k, num_spans) {
+            FR(x, spans[k].x1, spans[k].x2) {
+                double c_x = x - ent_rect_sdl.x + 0.5;
+                double c_u = c_x * mip.w / ent_rect_sdl.w;
+                int u = static_cast<int>(round(c_u - 0.5));
+                u = std::max(0, std::min(u, mip.w-1));
+
+                if (front_to_back) {
+                    draw_sprite_column(r, mip, u, x, rows, light);
+                } else {
+                    map_texture_column(r, sprite, u, x, ent_rect_view.y, ent_rect_view.y + ent_rect_view.h);
+                }
+            }
+        }
+    }
+
+}
+
+// Draw the world as seen from each view's camera into its target: everything
+// but the minimap and HUD. The level has to be streamed in around the cameras
+// already. The views share the pool: each stage runs the work of all of them
+// in one parallel_for, and the views find and draw their sprites in
+// parallel. The phase times of the whole frame go into `ms`. Only a lone
+// view can use the SDL backend.
+void render_views(Renderer * const * views, int num_views, ThreadPool * pool, double * ms)
+{
+    PROFILE_ZONE(ZONE_RENDER);
+    int counts[MAX_VIEWS];
+    bool sdl = views[0]->backend == BACKEND_SDL;
+
+    FOR(v, num_views) {
+        views[v]->arena.reset();
+        update_ray_table(*views[v]);
+        views[v]->screen_tan_max = views[v]->ray_table.screen_tan_max;
+    }
+
+    begin_phases(PHASE_FLOOR, PHASE_MINIMAP, ms);
+
+    //// ray-casting
+    FOR(v, num_views) {
+        views[v]->columns_cast = reuse_columns(*views[v]);
+        counts[v] = views[v]->columns_cast > 0 ? views[v]->cols : 0;
+    }
+    parallel_for_views(pool, views, num_views, counts, [](Renderer & r, int col1, int col2) { cast_stale_columns(r, col1, col2); });
+    FOR(v, num_views) save_columns(*views[v]);
+    end_phase(PHASE_RAYCAST, ms);
+
+    //// floor & ceiling
+    if (sdl) {
+        CHECK_SDL(SDL_SetRenderTarget(ren, pixel_screen.get()));
+    }
+
+    FOR(v, num_views) {
+        Renderer & r = *views[v];
+        counts[v] = 0;
+        if (r.backend == BACKEND_SOFTWARE && r.textured_floor) {
+            find_first_plane_row(r);
+            counts[v] = r.rows - r.first_plane_row;
+        } else {
+            setdrawcolor(r, 40, 40, 40);
+            drawtilerect(r, 0, 0, r.cols, r.rows);
+
+            setdrawcolor(r, 135, 206, 235);
+            drawtilerect(r, 0, 0, r.cols, r.rows/2);
+        }
+    }
+    parallel_for_views(pool, views, num_views, counts, [](Renderer & r, int row1, int row2) {
+        draw_plane_rows(r, r.first_plane_row + row1, r.first_plane_row + row2);
+    });
+    end_phase(PHASE_FLOOR, ms);
+
+    //// walls
+    if (!sdl) {
+        FOR(v, num_views) counts[v] = views[v]->cols;
+        parallel_for_views(pool, views, num_views, counts, [](Renderer & r, int col1, int col2) { draw_wall_columns(r, col1, col2); });
+    } else {
+        // SDL renderer calls have to stay on this thread
+        draw_wall_columns(*views[0], 0, views[0]->cols);
+    }
+    end_phase(PHASE_WALLS, ms);
+
+    //// sprites
+    if (!sdl && pool && num_views > 1) {
+        pool->parallel_for(num_views, [views](int v1, int v2) { FR(v, v1, v2) draw_sprites(*views[v]); });
+    } else {
+        FOR(v, num_views) draw_sprites(*views[v]);
+    }
+    end_phase(PHASE_SPRITES, ms);
+}
+
+// Draw one view; see render_views().
+void render_frame(Renderer & r, ThreadPool * pool = NULL)
+{
+    Renderer * views[1] = { &r };
+    render_views(views, 1, pool, r.phase_ms);
+}
+
+// Views
+// Besides the player's view the game can draw a second camera each frame:
+// with VIEWS_SPLIT the frame is split into the player's view on the left and
+// a chase camera behind the player on the right; with VIEWS_MIRROR a rear-view
+// mirror is inset at the top. Each half of a split keeps the full view's
+// vertical scale, so it sees a narrower slice. The mirror is drawn into a
+// buffer of its own and copied in flipped, since it covers part of the
+// player's view. The SDL backend only draws the player's view; see ViewLayout.
+const double CHASE_DIST = 1.5; // behind the player, unless a wall is nearer
+const double CHASE_WALL_GAP = 0.2;
+
+Renderer game_views[2]; // the player's, then the second camera's
+Uint32 mirror_pixels[TILE_ROWS][TILE_COLS];
+Uint8 mirror_indices[TILE_ROWS][TILE_COLS];
+
+// FOV that draws `cols` columns at the vertical scale of full_cols at FOV.
+double fov_for_cols(int cols, int full_cols)
+{
+    return atan(tan(M_PI * FOV) * (cols-1) / (full_cols-1)) / M_PI;
+}
+
+Camera chase_camera(Camera const & player)
+{
+    RayHit hit;
+    double back = CHASE_DIST;
+    if (cast_ray(player.x, player.y, -player.dx, -player.dy, hit)) back = std::min(back, to_double(hit.t) - CHASE_WALL_GAP);
+    back = std::max(back, 0.0);
+    return make_camera(player.x - back * player.dx, player.y - back * player.dy, player.angle);
+}
+
+void set_view_target(Renderer & r, FrameSlot & slot, int x0, int cols)
+{
+    r.pixels = &slot.pixels[0][x0];
+    r.indices = &slot.indices[0][x0];
+    r.pitch = TILE_COLS;
+    r.cols = cols;
+    r.rows = tile_rows;
+}
+
+// Copy the mirror view into the top middle of `r`'s target, flipped, with a
+// frame round it.
+void composite_mirror(Renderer & r, Renderer const & mirror)
+{
+    int x0 = (r.cols - mirror.cols) / 2;
+    int y0 = r.rows / 16;
+    setdrawcolor(r, 0, 0, 0);
+    drawtilerect(r, x0 - 1, y0 - 1, mirror.cols + 2, mirror.rows + 2);
+    FOR(y, mirror.rows) {
+        if (r.indexed) std::reverse_copy(mirror_indices[y], mirror_indices[y] + mirror.cols, r.index_row(y0 + y) + x0);
+        else std::reverse_copy(mirror_pixels[y], mirror_pixels[y] + mirror.cols, r.pixel_row(y0 + y) + x0);
+    }
+}
+
+// Draw the world as seen from `view` into `slot`, with the minimap. With the
+// software backend this makes no SDL calls, so it can run on the render thread.
+void render_world(FrameSlot & slot)
+{
+    stream_chunks(view.x, view.y);
+
+    ViewLayout layout = backend == BACKEND_SDL ? VIEWS_SINGLE : view_layout;
+    int num_views = layout == VIEWS_SINGLE ? 1 : 2;
+    FOR(v, num_views) {
+        Renderer & r = game_views[v];
+        r.fov = FOV;
+        r.backend = backend;
+        r.indexed = backend == BACKEND_SOFTWARE && indexed_color;
+        r.textured_floor = textured_floor;
+        r.reproject = reproject_columns;
+    }
+
+    Renderer & r = game_views[0];
+    Renderer & second = game_views[1];
+    r.camera = view;
+    set_view_target(r, slot, 0, tile_cols);
+    if (layout == VIEWS_SPLIT) {
+        int left = tile_cols / 2;
+        set_view_target(r, slot, 0, left);
+        set_view_target(second, slot, left, tile_cols - left);
+        r.fov = fov_for_cols(left, tile_cols);
+        second.fov = fov_for_cols(tile_cols - left, tile_cols);
+        second.camera = chase_camera(view);
+    } else if (layout == VIEWS_MIRROR) {
+        second.pixels = &mirror_pixels[0][0];
+        second.indices = &mirror_indices[0][0];
+        second.pitch = TILE_COLS;
+        second.cols = tile_cols / 3;
+        second.rows = tile_rows / 5;
+        second.camera = make_camera(view.x, view.y, view.angle + 0.5);
+        wrap_angle(second.camera.angle);
+    }
+
+    Renderer * views[2] = { &r, &second };
+    render_views(views, num_views, &render_pool, phase_ms);
+
+    slot.cols = tile_cols;
+    slot.rows = tile_rows;
+    slot.backend = r.backend;
+    slot.indexed = r.indexed;
+    slot.camera = r.camera;
+    slot.straight = r.column_hits[r.cols/2];
+    slot.columns_cast = 0;
+    FOR(v, num_views) slot.columns_cast += views[v]->columns_cast;
+
+    //// mini-map
+    // a MINIMAP_SIZE window of the level, kept around the player on big levels;
+    // the mirror is composited here too
+    begin_phases(PHASE_MINIMAP, PHASE_HUD);
+    if (layout == VIEWS_MIRROR) composite_mirror(r, second);
+    // in the frame's corner, not the left view's
+    if (layout == VIEWS_SPLIT) set_view_target(r, slot, 0, tile_cols);
+
+    int minimap_w = std::min(MINIMAP_SIZE, level.width);
+    int minimap_h = std::min(MINIMAP_SIZE, level.height);
+    int minimap_x0 = std::max(0, std::min(floor_to_int(view.x) - MINIMAP_SIZE/2, level.width - MINIMAP_SIZE));
+    int minimap_y0 = std::max(0, std::min(floor_to_int(view.y) - MINIMAP_SIZE/2, level.height - MINIMAP_SIZE));
+    update_minimap(minimap_x0, minimap_y0);
+    draw_minimap(r, minimap_w, minimap_h);
+
+    int minimap_x = floor_to_int(view.x) - minimap_x0;
+    int minimap_y = floor_to_int(view.y) - minimap_y0;
+    if (0 <= minimap_x && minimap_x < minimap_w && 0 <= minimap_y && minimap_y < minimap_h) {
+        setdrawcolor(r, 150, 63, 255);
+        drawtile(r, r.cols - MINIMAP_SIZE + minimap_x, minimap_y);
+    }
+    end_phase(PHASE_MINIMAP);
+}
+
+// Scale `slot` up to the window, draw the HUD over it and present it.
+void present_frame(FrameSlot const & slot)
+{
+    begin_phases(PHASE_HUD, PHASE_COUNT);
+
+    //// scale up
+    SDL_Rect drawn = { 0, 0, slot.cols, slot.rows };
+    if (slot.backend == BACKEND_SDL) {
+        CHECK_SDL(SDL_SetRenderTarget(ren, NULL));
+        CHECK_SDL(SDL_RenderCopy(ren, pixel_screen.get(), &drawn, NULL));
+    } else if (slot.indexed) {
+        // the one place palette indices turn into colours
+        void * pixels;
+        int pitch;
+        CHECK_SDL(SDL_LockTexture(framebuffer_tex.get(), &drawn, &pixels, &pitch));
+        FOR(y, slot.rows) {
+            Uint32 * out = reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(pixels) + y * pitch);
+            Uint8 const * in = slot.indices[y];
+            FOR(x, slot.cols) out[x] = palette->colors[in[x]];
+        }
+        SDL_UnlockTexture(framebuffer_tex.get());
+        CHECK_SDL(SDL_RenderCopy(ren, framebuffer_tex.get(), &drawn, NULL));
+    } else {
+        CHECK_SDL(SDL_UpdateTexture(framebuffer_tex.get(), &drawn, slot.pixels, sizeof(slot.pixels[0])));
+        CHECK_SDL(SDL_RenderCopy(ren, framebuffer_tex.get(), &drawn, NULL));
+    }
+    // upload and scale-up count towards present
+    end_phase(PHASE_PRESENT);
+
+    //// diagnostics
+    char buf[HUD_TEXT_LEN];
+
+    Camera const & cam = slot.camera;
+    snprintf(buf, sizeof(buf),
+        "X=%.2lf, Y=%.2lf, A=%.2lf, dX=%.2lf, dY=%.2lf ;  X=%.2lf, Y=%.2lf, D=%.2lf ;  t=%.1lf ms, lat=%.1lf ms, %dx%d, rays=%d, allocs=%lu, seen=%d, aim=%s %.1lf (%s, %s, %s, %s%s)",
+        cam.x, cam.y, cam.angle, cam.dx, cam.dy,
+        to_double(slot.straight.x), to_double(slot.straight.y), to_double(slot.straight.dist),
+        avgFrameTime_ms(), avgLatency_ms(), slot.cols, slot.rows, slot.columns_cast, frame_allocations,
+        entities_in_sight, aim.entity >= 0 ? "entity" : aim.wall ? "wall" : "nothing", aim.t, backend_name(), ray_kernel_name(), present_mode_name(), view_layout_name(),
+        pipeline_frames && slot.backend == BACKEND_SOFTWARE ? ", pipelined" : "");
+    draw_hud(buf);
+    if (show_profile_overlay) draw_profile_overlay();
+    end_phase(PHASE_HUD);
+
+    {
+        PROFILE_ZONE(ZONE_PRESENT);
+        SDL_RenderPresent(ren);
+    }
+    end_phase(PHASE_PRESENT);
+    latency_times.push(float(counter_to_ms(SDL_GetPerformanceCounter() - slot.input_time)));
+}
+
+void render()
+{
+    render_world(frame_slots[0]);
+    present_frame(frame_slots[0]);
+}
+
+// Asset pack
+// --bake-assets writes the textures, palette and glyph atlas into one file,
+// already decoded and laid out the way the renderer reads them, so startup
+// only points the MipLevels, palette and atlas at it: no PNG decoding, mip
+// building, quantizing or font rasterizing. Natively the pack is
+// memory-mapped; the web build preloads it as its only data file and reads it
+// whole. The format, little-endian, with every array ASSET_ALIGN-aligned:
+//
+//   AssetHeader, AssetSection[num_sections], then the sections.
+//
+// A textures section is a Uint32 count and AssetTexture[count]; a glyphs
+// section is an AssetGlyphs; a palette section is a Palette. Their arrays
+// follow them, at offsets from the start of the file. Sections of kinds a
+// reader doesn't know are skipped.
+const char ASSET_MAGIC[4] = { 'R', 'R', 'A', 'S' };
+const Uint32 ASSET_VERSION = 2;
+const size_t ASSET_ALIGN = 16;
+const char * const DEFAULT_ASSET_PATH = "data/assets.pak";
+
+// What startup spent getting the assets ready, for the benchmark report:
+// opening the pack (or decoding the files), then making the SDL textures.
+const char * asset_source = "pack";
+double asset_load_ms, asset_upload_ms;
+
+enum AssetSectionKind { SECTION_TEXTURES = 1, SECTION_GLYPHS = 2, SECTION_PALETTE = 3 };
+
+struct AssetHeader
+{
+    char magic[4];
+    Uint32 version;
+    Uint32 num_sections;
+    Uint32 reserved;
+};
+
+struct AssetSection
+{
+    Uint32 kind;
+    Uint32 offset, size;
+    Uint32 reserved;
+};
+
+struct AssetTexture
+{
+    char name[16];
+    Uint32 w, h;
+    Uint32 columns;   // Uint32 texels of every mip level, as in Texture::storage
+    Uint32 rows;      // Uint32 texels of level 0, row-major; 0 without an SDL texture
+    Uint32 indices;   // Uint8 palette indices, laid out like columns
+    Uint32 runs, num_runs; // TexelRun
+    Uint32 run_index, num_run_index; // Sint32, w+1 per mip level
+};
+
+struct AssetGlyphs
+{
+    Uint32 w, h;
+    Sint32 height, line_skip;
+    Glyph glyphs[GLYPH_COUNT];
+    Uint32 pixels; // Uint32 RGBA8888, row-major
+};
+
+struct AssetPack
+{
+    Uint8 const * image;
+    size_t size;
+    std::vector<Uint8> owned_image;
+    bool mapped;
+
+    AssetPack() : image(NULL), size(0), mapped(false) {}
+};
+AssetPack assets;
+
+void close_assets()
+{
+    palette = &palette_storage;
+#if HAVE_MMAP
+    if (assets.mapped) munmap(const_cast<Uint8 *>(assets.image), assets.size);
+#endif
+    assets = AssetPack();
+}
+
+// The n T's at `offset` in the pack, or NULL if they aren't all inside it.
+template <typename T>
+T const * pack_array(size_t offset, size_t n)
+{
+    if (offset % alignof(T) != 0 || offset > assets.size || n > (assets.size - offset) / sizeof(T)) return NULL;
+    return reinterpret_cast<T const *>(assets.image + offset);
+}
+
+// Point `tex` at its arrays in the pack. The draw code trusts the runs, so
+// they're checked to stay inside their columns.
+bool init_pack_texture(Texture & tex, AssetTexture const & t)
+{
+    if (t.w == 0 || t.h == 0 || t.w > 65535 || t.h > 65535) return false;
+    size_t num_texels = 0;
+    size_t num_index = 0;
+    for (size_t w = t.w, h = t.h; ; w = std::max<size_t>(w/2, 1), h = std::max<size_t>(h/2, 1)) {
+        num_texels += w * h;
+        num_index += w + 1;
+        if (w == 1 && h == 1) break;
+    }
+    Uint32 const * columns = pack_array<Uint32>(t.columns, num_texels);
+    TexelRun const * runs = pack_array<TexelRun>(t.runs, t.num_runs);
+    int const * run_index = pack_array<int>(t.run_index, num_index);
+    Uint32 const * rows = t.rows ? pack_array<Uint32>(t.rows, size_t(t.w) * t.h) : NULL;
+    Uint8 const * indices = pack_array<Uint8>(t.indices, num_texels);
+    if (!columns || !runs || !run_index || !indices || t.num_run_index != num_index || (t.rows && !rows)) return false;
+
+    tex.w = t.w;
+    tex.h = t.h;
+    tex.rows = rows;
+    tex.mips.clear();
+    std::vector<Uint32>().swap(tex.storage);
+    std::vector<TexelRun>().swap(tex.run_storage);
+    std::vector<int>().swap(tex.run_index_storage);
+    std::vector<Uint32>().swap(tex.row_storage);
+    std::vector<Uint8>().swap(tex.index_storage);
+
+    for (int w = tex.w, h = tex.h; ; w = std::max(w/2, 1), h = std::max(h/2, 1)) {
+        MipLevel level = { w, h, columns, runs, run_index, indices };
+        FOR(x, w) {
+            if (run_index[x] < 0 || run_index[x] > run_index[x+1] || Uint32(run_index[x+1]) > t.num_runs) return false;
+            for (TexelRun const * r = level.runs_begin(x); r != level.runs_end(x); ++r) {
+                if (r->y1 >= r->y2 || r->y2 > h) return false;
+            }
+        }
+        tex.mips.push_back(level);
+        columns += w * h;
+        indices += w * h;
+        run_index += w + 1;
+        if (w == 1 && h == 1) break;
+    }
+    return true;
+}
+
+bool init_pack_glyphs(AssetGlyphs const & g)
+{
+    Uint32 const * pixels = pack_array<Uint32>(g.pixels, size_t(g.w) * g.h);
+    if (!pixels || g.w == 0 || g.h == 0 || g.w > 16384 || g.h > 16384) return false;
+    glyph_atlas.w = g.w;
+    glyph_atlas.h = g.h;
+    glyph_atlas.height = g.height;
+    glyph_atlas.line_skip = g.line_skip;
+    std::copy(g.glyphs, g.glyphs + GLYPH_COUNT, glyph_atlas.glyphs);
+    glyph_atlas.pixels = pixels;
+    std::vector<Uint32>().swap(glyph_atlas.pixel_storage);
+    return true;
+}
+
+// Find the textures, palette and glyph atlas in the pack image.
+bool init_assets(const char * path)
+{
+    AssetHeader const * header = pack_array<AssetHeader>(0, 1);
+    if (!header || std::memcmp(header->magic, ASSET_MAGIC, 4) != 0 || header->version != ASSET_VERSION) {
+        fprintf(stderr, "%s: not an asset pack this build can read\n", path);
+        return false;
+    }
+    AssetSection const * sections = pack_array<AssetSection>(sizeof(AssetHeader), header->num_sections);
+    if (!sections) {
+        fprintf(stderr, "%s: truncated asset pack\n", path);
+        return false;
+    }
+
+    bool have_textures = false;
+    bool have_glyphs = false;
+    bool have_palette = false;
+    FOR(s, int(header->num_sections)) {
+        AssetSection const & section = sections[s];
+        if (section.kind == SECTION_TEXTURES) {
+            Uint32 const * count = pack_array<Uint32>(section.offset, 1);
+            AssetTexture const * table = count ? pack_array<AssetTexture>(section.offset + sizeof(Uint32), *count) : NULL;
+            if (!table) {
+                fprintf(stderr, "%s: truncated asset pack\n", path);
+                return false;
+            }
+            FOR(i, NUM_TEXTURE_ASSETS) {
+                TextureAsset const & asset = texture_assets[i];
+                AssetTexture const * t = std::find_if(table, table + *count, [&](AssetTexture const & e) {
+                    return strncmp(e.name, asset.name, sizeof(e.name)) == 0;
+                });
+                if (t == table + *count) {
+                    fprintf(stderr, "%s: no texture %s\n", path, asset.name);
+                    return false;
+                }
+                if (!init_pack_texture(*asset.tex, *t)) {
+                    fprintf(stderr, "%s: bad texture %s\n", path, asset.name);
+                    return false;
+                }
+            }
+            have_textures = true;
+        } else if (section.kind == SECTION_GLYPHS) {
+            AssetGlyphs const * glyphs = pack_array<AssetGlyphs>(section.offset, 1);
+            if (!glyphs || !init_pack_glyphs(*glyphs)) {
+                fprintf(stderr, "%s: bad glyph atlas\n", path);
+                return false;
+            }
+            have_glyphs = true;
+        } else if (section.kind == SECTION_PALETTE) {
+            Palette const * pal = pack_array<Palette>(section.offset, 1);
+            if (!pal) {
+                fprintf(stderr, "%s: truncated asset pack\n", path);
+                return false;
+            }
+            palette = pal;
+            have_palette = true;
+        }
+    }
+    if (!have_textures || !have_glyphs || !have_palette) {
+        fprintf(stderr, "%s: incomplete asset pack\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Open an asset pack and point the textures and glyph atlas into it.
+bool open_assets(const char * path)
+{
+    close_assets();
+#if HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    void * p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map %s\n", path);
+        return false;
+    }
+    assets.image = static_cast<Uint8 const *>(p);
+    assets.size = st.st_size;
+    assets.mapped = true;
+#else
+    // no mmap: read it whole
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return false;
+    }
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    bool ok = size > 0 && fseek(f, 0, SEEK_SET) == 0;
+    if (ok) {
+        assets.owned_image.resize(size);
+        ok = fread(&assets.owned_image[0], 1, size, f) == size_t(size);
+    }
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Couldn't read %s\n", path);
+        return false;
+    }
+    assets.image = &assets.owned_image[0];
+    assets.size = assets.owned_image.size();
+#endif
+    if (!init_assets(path)) {
+        close_assets();
+        return false;
+    }
+    return true;
+}
+
+// Without a pack: decode the PNGs, generate the floor and ceiling, quantize
+// them all to a palette, and rasterize the glyph atlas from the font. This is
+// also what gets baked.
+void load_asset_files()
+{
+    TTF_Font * font = TTF_OpenFont("data/Vera.ttf", FONT_HEIGHT);
+    if (!font) failTTF("TTF_OpenFont");
+    BuildGlyphAtlas(glyph_atlas, font);
+    TTF_CloseFont(font);
+
+    FOR(i, NUM_TEXTURE_ASSETS) {
+        if (texture_assets[i].path) LoadTexture(*texture_assets[i].tex, texture_assets[i].path);
+    }
+    GenerateTileTexture(floor_texture, 64, 2, rgba8888(96, 88, 80, 0xff), rgba8888(48, 44, 40, 0xff));
+    GenerateTileTexture(ceiling_texture, 64, 4, rgba8888(120, 120, 130, 0xff), rgba8888(70, 70, 78, 0xff));
+
+    std::vector<Texture const *> textures;
+    FOR(i, NUM_TEXTURE_ASSETS) textures.push_back(texture_assets[i].tex);
+    BuildPalette(textures);
+    FOR(i, NUM_TEXTURE_ASSETS) BuildTextureIndices(*texture_assets[i].tex);
+}
+
+// Make the SDL textures, once there's a renderer.
+void upload_assets()
+{
+    UploadGlyphAtlas(glyph_atlas, ren);
+    FOR(i, NUM_TEXTURE_ASSETS) UploadTexture(*texture_assets[i].tex, ren);
+}
+
+// Pad `out` to ASSET_ALIGN and append n T's there; returns their offset.
+template <typename T>
+Uint32 append_array(std::vector<Uint8> & out, T const * p, size_t n)
+{
+    out.resize((out.size() + ASSET_ALIGN - 1) / ASSET_ALIGN * ASSET_ALIGN, 0);
+    Uint32 offset = out.size();
+    Uint8 const * bytes = reinterpret_cast<Uint8 const *>(p);
+    out.insert(out.end(), bytes, bytes + n * sizeof(T));
+    return offset;
+}
+
+// Write the loaded textures, palette and glyph atlas out as an asset pack.
+bool bake_assets(const char * path)
+{
+    std::vector<Uint8> out;
+    AssetHeader header = { { ASSET_MAGIC[0], ASSET_MAGIC[1], ASSET_MAGIC[2], ASSET_MAGIC[3] }, ASSET_VERSION, 3, 0 };
+    append_array(out, &header, 1);
+    AssetSection sections[3];
+    std::memset(sections, 0, sizeof(sections));
+    Uint32 sections_offset = append_array(out, sections, 3);
+
+    // the tables are written once their arrays' offsets are known
+    std::vector<AssetTexture> table(NUM_TEXTURE_ASSETS);
+    Uint32 count = NUM_TEXTURE_ASSETS;
+    sections[0].kind = SECTION_TEXTURES;
+    sections[0].offset = append_array(out, &count, 1);
+    Uint32 table_offset = out.size(); // straight after the count
+    out.resize(out.size() + table.size() * sizeof(AssetTexture));
+    FOR(i, NUM_TEXTURE_ASSETS) {
+        Texture const & tex = *texture_assets[i].tex;
+        AssetTexture & t = table[i];
+        std::memset(&t, 0, sizeof(t));
+        strncpy(t.name, texture_assets[i].name, sizeof(t.name) - 1);
+        t.w = tex.w;
+        t.h = tex.h;
+        t.columns = append_array(out, tex.storage.data(), tex.storage.size());
+        t.rows = tex.rows ? append_array(out, tex.rows, size_t(tex.w) * tex.h) : 0;
+        t.indices = append_array(out, tex.index_storage.data(), tex.index_storage.size());
+        t.runs = append_array(out, tex.run_storage.data(), tex.run_storage.size());
+        t.num_runs = tex.run_storage.size();
+        t.run_index = append_array(out, tex.run_index_storage.data(), tex.run_index_storage.size());
+        t.num_run_index = tex.run_index_storage.size();
+    }
+    sections[0].size = out.size() - sections[0].offset;
+    std::memcpy(&out[table_offset], table.data(), table.size() * sizeof(AssetTexture));
+
+    AssetGlyphs glyphs;
+    std::memset(&glyphs, 0, sizeof(glyphs));
+    glyphs.w = glyph_atlas.w;
+    glyphs.h = glyph_atlas.h;
+    glyphs.height = glyph_atlas.height;
+    glyphs.line_skip = glyph_atlas.line_skip;
+    std::copy(glyph_atlas.glyphs, glyph_atlas.glyphs + GLYPH_COUNT, glyphs.glyphs);
+    sections[1].kind = SECTION_GLYPHS;
+    sections[1].offset = append_array(out, &glyphs, 1);
+    glyphs.pixels = append_array(out, glyph_atlas.pixels, size_t(glyph_atlas.w) * glyph_atlas.h);
+    sections[1].size = out.size() - sections[1].offset;
+    std::memcpy(&out[sections[1].offset], &glyphs, sizeof(glyphs));
+
+    sections[2].kind = SECTION_PALETTE;
+    sections[2].offset = append_array(out, palette, 1);
+    sections[2].size = sizeof(Palette);
+
+    std::memcpy(&out[sections_offset], sections, sizeof(sections));
+
+    FILE * f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+}
+
+Uint64 prevFrame;
+// Benchmark mode: flies a scripted camera path through the level at a fixed
+// timestep and reports per-phase frame timings.
+struct CameraKey
+{
+    double x, y, angle; // angle is unwrapped so keys can spin past 1
+    int frames;         // frames taken to reach this key from the previous one
+};
+
+const CameraKey bench_path[] = {
+    {  1.5, 14.5, 0.00,   0 },
+    { 12.5, 14.5, 0.00, 120 },
+    { 12.5, 14.5, 0.50,  30 },
+    {  3.5, 14.5, 0.50,  90 },
+    {  3.5, 14.5, 0.75,  20 },
+    {  3.5,  3.5, 0.75, 100 },
+    {  3.5,  3.5, 1.00,  20 },
+    { 12.5,  3.5, 1.00,  90 },
+    { 12.5,  3.5, 1.25,  20 },
+    { 12.5, 11.5, 1.25,  80 },
+    { 12.5, 11.5, 2.25, 120 },
+};
+const int BENCH_PATH_KEYS = sizeof(bench_path) / sizeof(bench_path[0]);
+
+const double BENCH_FRAME_S = 1.0 / 60;
+const int BENCH_WARMUP_FRAMES = 10;
+
+struct FrameSample
+{
+    double phase_ms[PHASE_COUNT];
+    double total_ms;
+    unsigned long allocations; // from the heap
+};
+
+bool bench_mode = false;
+int bench_frames = 0; // 0 means one pass over bench_path
+std::string bench_csv_path, bench_json_path;
+int bench_frame;
+std::vector<FrameSample> bench_samples;
+bool bench_failed; // the exit status says so
+
+int bench_path_frames()
+{
+    int ret = 0;
+    FOR(i, BENCH_PATH_KEYS) ret += bench_path[i].frames;
+    return ret;
+}
 
-                if (0 <= yf && yf < MAP_HEIGHT && map_grid[yf][x-1] == '#') {
-                    proj_xs[2] = x;
-                    proj_ys[2] = y;
-                    proj_dists[2] = player_dx * (x-player_x) + player_dy * (y-player_y);
-                    proj_colors[2] = 1;
-                    proj_tex_offsets[2] = static_cast<int>(16*(y-yf));
-                    break;
-                }
-            }
+// Camera pose for a frame; the path repeats if more frames are requested.
+void bench_pose(int frame, double & x, double & y, double & angle)
+{
+    frame %= bench_path_frames();
+    FR(i, 1, BENCH_PATH_KEYS) {
+        CameraKey const & a = bench_path[i-1];
+        CameraKey const & b = bench_path[i];
+        if (frame < b.frames) {
+            double u = double(frame) / b.frames;
+            x = a.x + (b.x - a.x) * u;
+            y = a.y + (b.y - a.y) * u;
+            angle = a.angle + (b.angle - a.angle) * u;
+            angle -= floor(angle);
+            return;
+        }
+        frame -= b.frames;
+    }
+    x = bench_path[0].x;
+    y = bench_path[0].y;
+    angle = bench_path[0].angle;
+}
+
+struct BenchStats
+{
+    double min, median, p99, mean;
+};
+
+BenchStats bench_stats(std::vector<double> v)
+{
+    BenchStats ret = { 0, 0, 0, 0 };
+    if (v.empty()) return ret;
+    std::sort(v.begin(), v.end());
+    ret.min = v.front();
+    ret.median = v[v.size() / 2];
+    ret.p99 = v[std::min(v.size() - 1, size_t(ceil(0.99 * v.size())) - 1)];
+    FOR(i, int(v.size())) ret.mean += v[i];
+    ret.mean /= v.size();
+    return ret;
+}
+
+// Stats for phase p over the post-warmup samples; p == PHASE_COUNT is the
+// total.
+BenchStats bench_phase_stats(int p)
+{
+    std::vector<double> v;
+    FR(i, std::min(BENCH_WARMUP_FRAMES, int(bench_samples.size())), int(bench_samples.size())) {
+        FrameSample const & f = bench_samples[i];
+        v.push_back(p == PHASE_COUNT ? f.total_ms : f.phase_ms[p]);
+    }
+    return bench_stats(v);
+}
+
+// Heap allocations over the post-warmup samples, and the most in one.
+void bench_allocations(unsigned long & total, unsigned long & most)
+{
+    total = most = 0;
+    FR(i, std::min(BENCH_WARMUP_FRAMES, int(bench_samples.size())), int(bench_samples.size())) {
+        total += bench_samples[i].allocations;
+        most = std::max(most, bench_samples[i].allocations);
+    }
+}
+
+const char * real_name()
+{
+#if RAYCAST_REAL == REAL_FIXED
+    return "fixed";
+#elif RAYCAST_REAL == REAL_FLOAT
+    return "float";
+#else
+    return "double";
+#endif
+}
+
+void write_bench_csv(const char * path)
+{
+    FILE * f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Couldn't write %s\n", path);
+        return;
+    }
+    fprintf(f, "frame");
+    FOR(p, PHASE_COUNT) fprintf(f, ",%s_ms", phase_names[p]);
+    fprintf(f, ",total_ms,allocations\n");
+    FOR(i, int(bench_samples.size())) {
+        fprintf(f, "%d", i);
+        FOR(p, PHASE_COUNT) fprintf(f, ",%.4f", bench_samples[i].phase_ms[p]);
+        fprintf(f, ",%.4f,%lu\n", bench_samples[i].total_ms, bench_samples[i].allocations);
+    }
+    fclose(f);
+}
+
+void write_bench_json(const char * path)
+{
+    FILE * f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Couldn't write %s\n", path);
+        return;
+    }
+    fprintf(f, "{\n");
+    fprintf(f, "  \"config\": { \"backend\": \"%s\", \"kernel\": \"%s\", \"real\": \"%s\", \"threads\": %d, \"cols\": %d, \"rows\": %d, \"frames\": %d, \"warmup\": %d },\n",
+        backend_name(), ray_kernel_name(), real_name(), render_pool.size(),
+        tile_cols, tile_rows, int(bench_samples.size()), BENCH_WARMUP_FRAMES);
+    fprintf(f, "  \"phases_ms\": {\n");
+    FOR(p, PHASE_COUNT + 1) {
+        BenchStats st = bench_phase_stats(p);
+        fprintf(f, "    \"%s\": { \"min\": %.4f, \"median\": %.4f, \"p99\": %.4f, \"mean\": %.4f }%s\n",
+            p == PHASE_COUNT ? "total" : phase_names[p], st.min, st.median, st.p99, st.mean,
+            p == PHASE_COUNT ? "" : ",");
+    }
+    fprintf(f, "  },\n");
+    unsigned long allocs, most_allocs;
+    bench_allocations(allocs, most_allocs);
+    fprintf(f, "  \"allocations\": { \"counted\": %s, \"total\": %lu, \"max_per_frame\": %lu },\n",
+        COUNT_ALLOCATIONS ? "true" : "false", allocs, most_allocs);
+    fprintf(f, "  \"assets_ms\": { \"source\": \"%s\", \"load\": %.4f, \"upload\": %.4f }\n}\n", asset_source, asset_load_ms, asset_upload_ms);
+    fclose(f);
+}
+
+void finish_bench()
+{
+    printf("bench: %d frames (%d warmup), backend=%s kernel=%s real=%s threads=%d, %dx%d\n",
+        int(bench_samples.size()), BENCH_WARMUP_FRAMES, backend_name(), ray_kernel_name(),
+        real_name(), render_pool.size(), tile_cols, tile_rows);
+    printf("%-8s %9s %9s %9s %9s\n", "phase", "min", "median", "p99", "mean");
+    FOR(p, PHASE_COUNT + 1) {
+        BenchStats st = bench_phase_stats(p);
+        printf("%-8s %9.3f %9.3f %9.3f %9.3f\n",
+            p == PHASE_COUNT ? "total" : phase_names[p], st.min, st.median, st.p99, st.mean);
+    }
+    printf("assets: %.3f ms load (%s), %.3f ms upload\n", asset_load_ms, asset_source, asset_upload_ms);
+    unsigned long allocs, most_allocs;
+    bench_allocations(allocs, most_allocs);
+    if (COUNT_ALLOCATIONS) {
+        printf("heap allocations: %lu after warmup, at most %lu in a frame\n", allocs, most_allocs);
+        if (allocs > 0) {
+            fprintf(stderr, "bench: frames after the warmup allocated from the heap\n");
+            bench_failed = true;
+        }
+    }
+
+    if (!bench_csv_path.empty()) write_bench_csv(bench_csv_path.c_str());
+    if (!bench_json_path.empty()) write_bench_json(bench_json_path.c_str());
+}
+
+void bench_step()
+{
+    if (bench_frame == 0) bench_samples.reserve(bench_frames);
+
+    bench_pose(bench_frame, player_x, player_y, player_angle);
+    set_view(player_x, player_y, player_angle);
+    deltaFrame_s = BENCH_FRAME_S;
+    handle_events();
+
+    unsigned long allocs = heap_allocations.load(std::memory_order_relaxed);
+    Uint64 start = SDL_GetPerformanceCounter();
+    frame_slots[0].input_time = start;
+    render();
+    FrameSample sample;
+    sample.total_ms = counter_to_ms(SDL_GetPerformanceCounter() - start);
+    std::copy(phase_ms, phase_ms + PHASE_COUNT, sample.phase_ms);
+    end_profile_frame(sample.total_ms);
+    sample.allocations = heap_allocations.load(std::memory_order_relaxed) - allocs;
+    bench_samples.push_back(sample);
+
+    ++bench_frame;
+    if (bench_frame >= bench_frames || quitRequested) {
+        finish_bench();
+        quitRequested = true;
+#ifdef __EMSCRIPTEN__
+        emscripten_cancel_main_loop();
+#endif
+    }
+}
+
+// Batch rendering
+// --batch=PATH draws the camera poses listed in PATH, one "x y angle" per line
+// (angle in turns), with no window and no SDL video, as fast as it can: each
+// pool thread has its own Renderer and draws whole frames, taking the next
+// pose as it finishes one. Poses are grouped by the chunk they stream in
+// around, so the level is streamed once per group and left alone while the
+// group renders. With --batch-out=DIR each frame is written to
+// DIR/NNNNNN.ppm, numbered by its pose's place in PATH.
+struct BatchPose
+{
+    double x, y, angle;
+    int index;  // in the file
+    int centre; // stream_centre() of the pose
+};
+
+struct BatchThread
+{
+    Renderer renderer;
+    std::vector<Uint32> pixels;
+    std::vector<Uint8> indices;
+};
+
+bool read_batch_poses(const char * path, std::vector<BatchPose> & poses)
+{
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return false;
+    }
+    char line[256];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        ++line_no;
+        BatchPose pose;
+        int n = sscanf(line, "%lf %lf %lf", &pose.x, &pose.y, &pose.angle);
+        if (n <= 0) continue; // blank or a comment
+        if (n != 3) {
+            fprintf(stderr, "%s:%d: expected x y angle\n", path, line_no);
+            ok = false;
+            break;
+        }
+        wrap_angle(pose.angle);
+        pose.index = static_cast<int>(poses.size());
+        pose.centre = stream_centre(pose.x, pose.y);
+        poses.push_back(pose);
+    }
+    fclose(f);
+    return ok;
+}
+
+// What `r` last drew, as 8-bit RGB.
+void frame_rgb(Renderer const & r, std::vector<Uint8> & rgb)
+{
+    rgb.resize(3 * r.cols * r.rows);
+    Uint8 * out = rgb.empty() ? NULL : &rgb[0];
+    FOR(y, r.rows) {
+        FOR(x, r.cols) {
+            Uint32 c = r.indexed ? palette->colors[r.indices[y * r.pitch + x]] : r.pixels[y * r.pitch + x];
+            *out++ = Uint8(c >> 24);
+            *out++ = Uint8(c >> 16);
+            *out++ = Uint8(c >> 8);
         }
+    }
+}
 
-        if (0.5 < col_angle && col_angle < 1.0) {
-            // intersect ray with south-facing walls
-            double slope = tan(2*M_PI * (0.25-col_angle));
+// Write a w x h RGB image as a binary PPM.
+bool write_ppm(const char * path, int w, int h, std::vector<Uint8> const & rgb)
+{
+    FILE * f = fopen(path, "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    bool ok = rgb.empty() || fwrite(&rgb[0], 1, rgb.size(), f) == rgb.size();
+    return fclose(f) == 0 && ok;
+}
 
-            int y1 = static_cast<int>(floor(player_y));
-            y1 = std::min(y1, MAP_HEIGHT-1);
+// Write what `r` last drew as a binary PPM.
+bool write_ppm(const char * path, Renderer const & r)
+{
+    std::vector<Uint8> rgb;
+    frame_rgb(r, rgb);
+    return write_ppm(path, r.cols, r.rows, rgb);
+}
 
-            for (int y = y1; y >= 1; --y) {
-                double x = (y-player_y) * slope + player_x;
-                int xf = static_cast<int>(x);
+int run_batch(const char * path, const char * out_dir)
+{
+    std::vector<BatchPose> poses;
+    if (!read_batch_poses(path, poses)) return 1;
+    std::stable_sort(BEND(poses), [](BatchPose const & a, BatchPose const & b) { return a.centre < b.centre; });
+
+    std::vector<BatchThread> threads(render_pool.size());
+    for (BatchThread & t : threads) {
+        t.pixels.resize(TILE_ROWS * TILE_COLS);
+        t.indices.resize(TILE_ROWS * TILE_COLS);
+        Renderer & r = t.renderer;
+        r.cols = tile_cols;
+        r.rows = tile_rows;
+        r.pixels = &t.pixels[0];
+        r.indices = &t.indices[0];
+        r.pitch = TILE_COLS;
+        r.indexed = indexed_color;
+        r.textured_floor = textured_floor;
+    }
 
-                if (0 <= xf && xf < MAP_WIDTH && map_grid[y-1][xf] == '#') {
-                    proj_xs[3] = x;
-                    proj_ys[3] = y;
-                    proj_dists[3] = player_dx * (x-player_x) + player_dy * (y-player_y);
-                    proj_colors[3] = 2;
-                    proj_tex_offsets[3] = static_cast<int>(16*(x-xf));
-                    break;
+    Uint64 start = SDL_GetPerformanceCounter();
+    std::atomic<bool> failed(false);
+    int n = static_cast<int>(poses.size());
+    for (int g1 = 0, g2; g1 < n; g1 = g2) {
+        for (g2 = g1 + 1; g2 < n && poses[g2].centre == poses[g1].centre; ++g2) {}
+        stream_chunks(poses[g1].x, poses[g1].y);
+
+        std::atomic<int> next(g1);
+        render_pool.parallel_for(render_pool.size(), [&](int, int) {
+            BatchThread & t = threads[worker_index];
+            for (int k; (k = next++) < g2; ) {
+                BatchPose const & pose = poses[k];
+                t.renderer.camera = make_camera(pose.x, pose.y, pose.angle);
+                render_frame(t.renderer);
+                if (!out_dir) continue;
+                char frame_path[1024];
+                snprintf(frame_path, sizeof(frame_path), "%s/%06d.ppm", out_dir, pose.index);
+                if (!write_ppm(frame_path, t.renderer) && !failed.exchange(true)) {
+                    fprintf(stderr, "Couldn't write %s\n", frame_path);
                 }
             }
+        });
+    }
+    double ms = counter_to_ms(SDL_GetPerformanceCounter() - start);
+
+    printf("batch: %d frames in %.1f ms, %.1f frames/s, backend=%s kernel=%s real=%s threads=%d, %dx%d\n",
+        n, ms, ms > 0 ? n * 1000.0 / ms : 0.0, indexed_color ? "sw8" : "sw", ray_kernel_name(), real_name(),
+        render_pool.size(), tile_cols, tile_rows);
+    return failed ? 1 : 0;
+}
+
+// Regression suite
+// --regress=DIR draws a fixed set of camera poses over three levels (the
+// built-in one, a large generated maze with doors, and an arena full of
+// frogs) with no window, and checks the frames against DIR:
+//   - each pose, drawn by the scalar kernel on the sw and sw8 backends,
+//     against its golden image DIR/LEVEL-NN-BACKEND.png;
+//   - the SIMD kernel's frames against the scalar kernel's;
+//   - a frame reprojected after a small turn against the same frame cast
+//     afresh, which it only approximates.
+// A pixel differs if a channel is more than REGRESS_CHANNEL_TOLERANCE off,
+// and a frame fails if too many of its pixels differ; it's then written to
+// DIR as LEVEL-NN-BACKEND[-simd|-reproject]-fail.png. Every other door is
+// left half open, so rays pass them.
+//
+// Each level, backend and kernel is also timed on the render pool. A sample
+// of a pose draws it for at least REGRESS_SAMPLE_MS, so that short frames
+// aren't lost in the timer's and the scheduler's noise, and each pose takes
+// its best of REGRESS_REPEATS samples. If DIR/timings.txt has a baseline
+// (lines of "level variant ms"), a variant fails if it's more than
+// REGRESS_SLOWDOWN times and REGRESS_SLOWDOWN_MS slower than it every time
+// it's timed; the absolute margin keeps sub-millisecond frames from failing
+// on a busy machine. Whatever the baseline, the SIMD kernel fails if it's
+// REGRESS_SLOWDOWN times slower than the scalar one, which is timed in the
+// same passes and so sees the same load. The run's own timings go to
+// DIR/last-timings.txt.
+//
+// --regress-update=goldens records the goldens instead. They're kept in the
+// repository, so record them with the default RAYCAST_REAL=double build and
+// from a tree known to draw right. --regress-update=timings records the
+// baseline, which is only good for the machine it was timed on, so that
+// stays out of the repository.
+const int REGRESS_CHANNEL_TOLERANCE = 2;
+const double REGRESS_MAX_DIFFERING = 0.001;       // fraction of a frame's pixels
+const double REGRESS_REPROJECT_DIFFERING = 0.005;
+// The goldens come from the double build. Float and fixed point round a
+// little differently, mostly along edges seen at a grazing angle, so other
+// builds only catch bigger changes against them.
+const double REGRESS_GOLDEN_DIFFERING = RAYCAST_REAL == REAL_DOUBLE ? REGRESS_MAX_DIFFERING : 0.02;
+const double REGRESS_TURN = 0.0025;               // in turns, a few columns
+const double REGRESS_SAMPLE_MS = 5;
+const double REGRESS_SLOWDOWN = 1.25;
+const double REGRESS_SLOWDOWN_MS = 0.25;          // per frame
+const int REGRESS_REPEATS = 3;
+const int REGRESS_RETIMES = 2;
+const int REGRESS_POSES = 8;        // for the generated levels
+const int REGRESS_MAZE_PASSAGES = 255; // across; the maze is twice that plus one cells wide
+const int REGRESS_ARENA_SIZE = 64;
+
+struct RegressPose
+{
+    double x, y, angle;
+};
+
+struct RegressLevel
+{
+    const char * name;
+    std::vector<std::string> rows;
+    std::vector<RegressPose> poses;
+    int split_pose; // also drawn as the game's split view, minimap and all; or -1
+};
+
+struct RegressTiming
+{
+    std::string level, variant;
+    double ms; // per frame
+};
+
+// Small fixed generator, so the generated levels and poses are the same on
+// every platform.
+Uint32 regress_random(Uint32 & state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// A maze of n x n passages cut by a depth-first walk from the top left one,
+// with walls of a different material every 16 cells and a door in about one
+// in 16 of the openings between passages.
+std::vector<std::string> regress_maze(int n, Uint32 seed)
+{
+    static const int dx[4] = { 1, -1, 0, 0 }, dy[4] = { 0, 0, 1, -1 };
+    const char materials[] = "#23456789ABCDEF";
+    int size = 2*n + 1;
+    std::vector<std::string> rows(size, std::string(size, '#'));
+    FOR(y, size) FOR(x, size) rows[y][x] = materials[((x >> 4) + 3 * (y >> 4)) % 15];
+
+    std::vector<int> stack(1, 0);
+    rows[1][1] = '.';
+    while (!stack.empty()) {
+        int cx = stack.back() % n, cy = stack.back() / n;
+        int dirs[4], num_dirs = 0;
+        FOR(d, 4) {
+            int nx = cx + dx[d], ny = cy + dy[d];
+            if (0 <= nx && nx < n && 0 <= ny && ny < n && rows[2*ny + 1][2*nx + 1] != '.') dirs[num_dirs++] = d;
+        }
+        if (num_dirs == 0) {
+            stack.pop_back();
+            continue;
+        }
+        int d = dirs[regress_random(seed) % num_dirs];
+        int nx = cx + dx[d], ny = cy + dy[d];
+        rows[2*ny + 1][2*nx + 1] = '.';
+        rows[cy + ny + 1][cx + nx + 1] = regress_random(seed) % 16 == 0 ? 'd' : '.';
+        stack.push_back(ny * n + nx);
+    }
+    rows[1][1] = 'p';
+    return rows;
+}
+
+// A walled size x size room with pillars, and a frog on most cells of every
+// third row and column.
+std::vector<std::string> regress_arena(int size, Uint32 seed)
+{
+    std::vector<std::string> rows(size, std::string(size, '.'));
+    FOR(y, size) FOR(x, size) {
+        char & c = rows[y][x];
+        if (x == 0 || y == 0 || x == size-1 || y == size-1) c = '#';
+        else if ((x & 7) >= 4 && (x & 7) < 6 && (y & 7) >= 4 && (y & 7) < 6) c = "23456789"[((x >> 3) + (y >> 3)) & 7];
+        else if (x % 3 == 1 && y % 3 == 1 && regress_random(seed) % 4 != 0) c = 'f';
+    }
+    rows[size/2][size/2] = 'p';
+    return rows;
+}
+
+std::vector<RegressLevel> regress_levels()
+{
+    static const RegressPose builtin_poses[] = {
+        { 1.5, 14.5, 0 }, { 8.3, 5.2, 0.13 }, { 3.7, 3.1, 0.61 }, { 12.5, 12.5, 0.875 },
+        { 5.0, 11.0, 0.25 }, { -3, 7.5, 0.02 }, { 10.2, 1.5, 0.5 }, { 14.9, 3.5, 0.37 }, { 4.5, 12.5, 0 },
+    };
+    std::vector<RegressLevel> levels(3);
+    levels[0].name = "builtin";
+    levels[0].rows.assign(map_grid, map_grid + MAP_HEIGHT);
+    levels[0].poses.assign(builtin_poses, builtin_poses + sizeof(builtin_poses) / sizeof(builtin_poses[0]));
+    levels[0].split_pose = 1;
+    levels[1].name = "maze";
+    levels[1].rows = regress_maze(REGRESS_MAZE_PASSAGES, 1);
+    levels[2].name = "arena";
+    levels[2].rows = regress_arena(REGRESS_ARENA_SIZE, 2);
+
+    // the generated levels are seen from random empty cells, roughly along
+    // a way out of the cell
+    Uint32 seed = 3;
+    FR(i, 1, 3) {
+        RegressLevel & lv = levels[i];
+        lv.split_pose = -1;
+        while (int(lv.poses.size()) < REGRESS_POSES) {
+            int x = 1 + regress_random(seed) % (lv.rows[0].size() - 2), y = 1 + regress_random(seed) % (lv.rows.size() - 2);
+            int turn = regress_random(seed) & 3;
+            int dx = turn == 0 ? 1 : turn == 2 ? -1 : 0, dy = turn == 1 ? 1 : turn == 3 ? -1 : 0;
+            if (lv.rows[y][x] != '.' || text_cell_material(lv.rows[y + dy][x + dx]) != CELL_EMPTY) continue;
+            RegressPose pose = { x + 0.25 + (regress_random(seed) & 255) / 512.0, y + 0.25 + (regress_random(seed) & 255) / 512.0,
+                turn / 4.0 + ((regress_random(seed) & 255) - 128) / 2048.0 };
+            wrap_angle(pose.angle);
+            lv.poses.push_back(pose);
+        }
+    }
+    return levels;
+}
+
+// Write a w x h RGB image as a PNG, which keeps the goldens small.
+bool write_png(const char * path, int w, int h, std::vector<Uint8> const & rgb)
+{
+    sdl_ptr<SDL_Surface> surf(SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA8888));
+    if (!surf) return false;
+    FOR(y, h) {
+        Uint32 * row = reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(surf->pixels) + y * surf->pitch);
+        FOR(x, w) {
+            Uint8 const * c = &rgb[3 * (y * w + x)];
+            row[x] = rgba8888(c[0], c[1], c[2], 255);
         }
+    }
+    return IMG_SavePNG(surf.get(), path) == 0;
+}
 
-        // render the column
-        double proj_x = 0;
-        double proj_y = 0;
-        double proj_dist = 0;
-        int proj_color = 0;
-        int proj_tex_offset = 0;
-        FOR(dir,4) if (proj_dists[dir] != 0 && (proj_dist == 0 || proj_dists[dir] < proj_dist)) {
-            proj_x = proj_xs[dir];
-            proj_y = proj_ys[dir];
-            proj_dist = proj_dists[dir];
-            proj_color = proj_colors[dir];
-            proj_tex_offset = proj_tex_offsets[dir];
+// Read a PNG into `rgb`, as 8-bit RGB.
+bool read_png(const char * path, int & w, int & h, std::vector<Uint8> & rgb)
+{
+    sdl_ptr<SDL_Surface> loaded(IMG_Load(path));
+    if (!loaded) return false;
+    sdl_ptr<SDL_Surface> surf(SDL_ConvertSurfaceFormat(loaded.get(), SDL_PIXELFORMAT_RGBA8888, 0));
+    if (!surf) return false;
+    w = surf->w;
+    h = surf->h;
+    rgb.resize(size_t(3) * w * h);
+    FOR(y, h) {
+        Uint32 const * row = reinterpret_cast<Uint32 const *>(static_cast<Uint8 const *>(surf->pixels) + y * surf->pitch);
+        FOR(x, w) {
+            Uint8 * c = &rgb[3 * (y * w + x)];
+            c[0] = Uint8(row[x] >> 24);
+            c[1] = Uint8(row[x] >> 16);
+            c[2] = Uint8(row[x] >> 8);
         }
+    }
+    return true;
+}
+
+// Pixels of two same-sized RGB images with a channel more than
+// REGRESS_CHANNEL_TOLERANCE apart.
+int count_differing(std::vector<Uint8> const & a, std::vector<Uint8> const & b)
+{
+    int n = 0;
+    for (size_t i = 0; i + 2 < a.size(); i += 3) {
+        if (std::abs(a[i] - b[i]) > REGRESS_CHANNEL_TOLERANCE || std::abs(a[i+1] - b[i+1]) > REGRESS_CHANNEL_TOLERANCE ||
+            std::abs(a[i+2] - b[i+2]) > REGRESS_CHANNEL_TOLERANCE) ++n;
+    }
+    return n;
+}
 
-        column_dist[screen_col] = proj_dist;
+RegressTiming const * find_timing(std::vector<RegressTiming> const & timings, std::string const & level_name, std::string const & variant)
+{
+    for (RegressTiming const & t : timings) {
+        if (t.level == level_name && t.variant == variant) return &t;
+    }
+    return NULL;
+}
 
-        if (proj_dist != 0) {
-            // TODO: Be more sensible when proj_dist is close to zero.
-            double viewport_unit_per_wall_unit = 1.0 / proj_dist;
+bool read_regress_timings(const char * path, std::vector<RegressTiming> & timings)
+{
+    FILE * f = fopen(path, "r");
+    if (!f) return false;
+    char line[256], level_name[64], variant[64];
+    double ms;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %63s %lf", level_name, variant, &ms) != 3) continue;
+        RegressTiming t = { level_name, variant, ms };
+        timings.push_back(t);
+    }
+    fclose(f);
+    return true;
+}
 
-            double wall_viewport_height = viewport_unit_per_wall_unit;
+bool write_regress_timings(const char * path, std::vector<RegressTiming> const & timings)
+{
+    FILE * f = fopen(path, "w");
+    if (!f) return false;
+    for (RegressTiming const & t : timings) fprintf(f, "%s %s %.3f\n", t.level.c_str(), t.variant.c_str(), t.ms);
+    return fclose(f) == 0;
+}
 
-            double view_y1 = -wall_viewport_height/2.0;
-            double view_y2 = wall_viewport_height/2.0;
+// Shots and sight lines on the built-in level with known answers. The two
+// extra frogs straddle an entity grid cell edge (y = 8) beside the shots,
+// their centres on the far side of it.
+int regress_queries()
+{
+    if (!open_builtin_level()) return 1;
+    spawn_level();
+    stream_chunks(0.5 * MAP_WIDTH, 0.5 * MAP_HEIGHT);
+    int below = add_entity(frog_sprite, 4, 8.3), above = add_entity(frog_sprite, 6, 7.7);
+
+    struct { double x, y, angle; int entity; double t; } scans[] = {
+        { 2.5, 7.95, 0, below, 1.306 },
+        { 4.6, 8.05, 0, above, 1.206 },
+        { 2.5, 10.5, 0, -1, 4.5 },   // the wall at x = 7
+    };
+    struct { double x0, y0, x1, y1; bool clear; } sights[] = {
+        { 2.5, 10.5, 6.5, 10.5, true },
+        { 2.5, 10.5, 10.5, 10.5, false },
+    };
+    int failures = 0;
+    FOR(i, int(sizeof(scans) / sizeof(scans[0]))) {
+        ScanHit hit = hitscan(scans[i].x, scans[i].y, scans[i].angle, AIM_RANGE);
+        if (hit.entity == scans[i].entity && (hit.entity >= 0 || hit.wall) && fabs(hit.t - scans[i].t) < 0.01) continue;
+        ++failures;
+        printf("FAIL hitscan from %g %g: hit %s %d at %.3f, expected %d at %.3f\n", scans[i].x, scans[i].y,
+            hit.wall ? "wall" : "entity", hit.entity, hit.t, scans[i].entity, scans[i].t);
+    }
+    FOR(i, int(sizeof(sights) / sizeof(sights[0]))) {
+        if (line_of_sight(sights[i].x0, sights[i].y0, sights[i].x1, sights[i].y1) == sights[i].clear) continue;
+        ++failures;
+        printf("FAIL line of sight from %g %g to %g %g: expected %s\n", sights[i].x0, sights[i].y0, sights[i].x1, sights[i].y1,
+            sights[i].clear ? "clear" : "blocked");
+    }
+    return failures;
+}
 
-            SDL_Texture * tex = NULL;
-            if (proj_color == 2) {
-                tex = green_2panel.get();
-            } else {
-                tex = red_2panel.get();
+// Why t is too slow, or NULL: slower than its baseline, if there is one, or
+// for the SIMD kernel, slower than the scalar one timed alongside it.
+const char * regress_slowdown(RegressTiming const & t, std::vector<RegressTiming> const & baseline, std::vector<RegressTiming> const & timings)
+{
+    RegressTiming const * base = find_timing(baseline, t.level, t.variant);
+    if (base && t.ms > REGRESS_SLOWDOWN * base->ms && t.ms > base->ms + REGRESS_SLOWDOWN_MS) return "slower than the baseline";
+    size_t simd = t.variant.find("-simd");
+    if (simd == std::string::npos) return NULL;
+    RegressTiming const * scalar = find_timing(timings, t.level, t.variant.substr(0, simd) + "-scalar");
+    if (scalar && t.ms > REGRESS_SLOWDOWN * scalar->ms) return "slower than the scalar kernel";
+    return NULL;
+}
+
+// What --regress-update records.
+enum RegressUpdate { REGRESS_CHECK, REGRESS_UPDATE_GOLDENS, REGRESS_UPDATE_TIMINGS };
+
+int run_regress(const char * dir, RegressUpdate update)
+{
+    char path[1024];
+    std::vector<RegressTiming> baseline, timings;
+    snprintf(path, sizeof(path), "%s/timings.txt", dir);
+    if (!update && !read_regress_timings(path, baseline)) {
+        printf("regress: no baseline at %s, so frame times aren't checked (record one with --regress-update=timings)\n", path);
+    }
+
+    std::vector<Uint32> pixels(TILE_ROWS * TILE_COLS);
+    std::vector<Uint8> indices(TILE_ROWS * TILE_COLS);
+    std::vector<Uint8> reference, frame, golden;
+    int goldens = 0, frames = 0, failures = 0;
+    const int num_kernels = HAVE_RAY_SIMD ? 2 : 1;
+
+    // check `frame` against `expected`, failing if more than max_differing of
+    // its pixels differ
+    auto check = [&](Renderer const & r, std::vector<Uint8> const & expected, char const * what, char const * name, double max_differing) {
+        ++frames;
+        int n = count_differing(frame, expected);
+        snprintf(path, sizeof(path), "%s/%s-fail.png", dir, name);
+        if (n <= max_differing * r.cols * r.rows) {
+            remove(path); // from an earlier run
+            return;
+        }
+        ++failures;
+        printf("FAIL %s: %d of %d pixels differ from %s; wrote %s\n", name, n, r.cols * r.rows, what, path);
+        if (!write_png(path, r.cols, r.rows, frame)) fprintf(stderr, "Couldn't write %s\n", path);
+    };
+    // check `frame` against the golden image `name`, or record it as that;
+    // false if it couldn't be written
+    auto check_golden = [&](Renderer const & r, char const * name) {
+        snprintf(path, sizeof(path), "%s/%s.png", dir, name);
+        if (update == REGRESS_UPDATE_GOLDENS) {
+            ++goldens;
+            if (write_png(path, r.cols, r.rows, frame)) return true;
+            fprintf(stderr, "Couldn't write %s\n", path);
+            return false;
+        }
+        int w, h;
+        if (!read_png(path, w, h, golden) || w != r.cols || h != r.rows) {
+            ++failures;
+            printf("FAIL %s: no golden image of %dx%d at %s (record them with --regress-update=goldens)\n", name, r.cols, r.rows, path);
+            return true;
+        }
+        check(r, golden, "the golden", name, REGRESS_GOLDEN_DIFFERING);
+        return true;
+    };
+
+    for (RegressLevel const & lv : regress_levels()) {
+        if (!open_level_image(level_image_from_text(lv.rows), lv.name)) return 1;
+        spawn_level();
+        for (size_t i = 0; i < movers.size(); i += 2) {
+            if (movers[i].kind != MOVER_DOOR) continue;
+            movers[i].offset = 0.5;
+            update_mover_box(movers[i]);
+        }
+
+        // a fresh one per level: its column cache goes by level.revision
+        std::unique_ptr<Renderer> r(new Renderer());
+        r->cols = TILE_COLS;
+        r->rows = TILE_ROWS;
+        r->pixels = &pixels[0];
+        r->indices = &indices[0];
+        r->pitch = TILE_COLS;
+
+        // time each variant by the best of REGRESS_REPEATS samples of each
+        // pose, taken in passes over all of them so a busy spell can't spoil
+        // them all; one that looks too slow gets REGRESS_RETIMES more tries
+        int num_poses = int(lv.poses.size());
+        std::vector<double> best(4 * num_poses, std::numeric_limits<double>::max()); // by pose, indexed, kernel
+        size_t level_timings = timings.size();
+        FOR(tries, REGRESS_RETIMES + 1) {
+            FOR(k, REGRESS_REPEATS) {
+                FOR(p, num_poses) {
+                    RegressPose const & pose = lv.poses[p];
+                    stream_chunks(pose.x, pose.y);
+                    FOR(indexed, 2) FOR(kernel, num_kernels) {
+                        r->indexed = indexed != 0;
+                        ray_kernel = kernel ? KERNEL_SIMD : KERNEL_SCALAR;
+                        r->camera = make_camera(pose.x, pose.y, pose.angle);
+                        Uint64 start = SDL_GetPerformanceCounter();
+                        double ms;
+                        int draws = 0;
+                        do {
+                            r->column_cache.valid = false;
+                            render_frame(*r, &render_pool);
+                            ++draws;
+                            ms = counter_to_ms(SDL_GetPerformanceCounter() - start);
+                        } while (ms < REGRESS_SAMPLE_MS);
+                        double & b = best[4*p + 2*indexed + kernel];
+                        b = std::min(b, ms / draws);
+                    }
+                }
+            }
+            timings.resize(level_timings);
+            bool slow = false;
+            FOR(indexed, 2) FOR(kernel, num_kernels) {
+                RegressTiming t = { lv.name, std::string(indexed ? "sw8-" : "sw-") + (kernel ? "simd" : "scalar"), 0 };
+                FOR(p, num_poses) t.ms += best[4*p + 2*indexed + kernel] / num_poses;
+                timings.push_back(t);
             }
+            for (size_t i = level_timings; i < timings.size(); ++i) slow = slow || regress_slowdown(timings[i], baseline, timings);
+            if (!slow) break;
+        }
 
-            map_texture_column(tex, proj_tex_offset, screen_col, view_y1, view_y2);
+        FOR(p, num_poses) {
+            RegressPose const & pose = lv.poses[p];
+            stream_chunks(pose.x, pose.y);
+            FOR(indexed, 2) {
+                r->indexed = indexed != 0;
+                char name[256];
+                snprintf(name, sizeof(name), "%s-%02d-%s", lv.name, p, indexed ? "sw8" : "sw");
+                FOR(kernel, num_kernels) {
+                    ray_kernel = kernel ? KERNEL_SIMD : KERNEL_SCALAR;
+                    r->camera = make_camera(pose.x, pose.y, pose.angle);
+                    r->column_cache.valid = false;
+                    render_frame(*r, &render_pool);
+                    frame_rgb(*r, frame);
+
+                    if (kernel) {
+                        char simd_name[300];
+                        snprintf(simd_name, sizeof(simd_name), "%s-simd", name);
+                        check(*r, reference, "the scalar kernel's", simd_name, REGRESS_MAX_DIFFERING);
+                        continue;
+                    }
+                    reference = frame;
+                    if (!check_golden(*r, name)) return 1;
+                }
+            }
 
-            // for diagnostics
-            if (screen_col == TILE_COLS/2) {
-                straight_x = proj_x;
-                straight_y = proj_y;
-                straight_dist = proj_dist;
+            // turn a little from the pose, reusing its rays, and compare with
+            // casting them all
+            char name[256];
+            snprintf(name, sizeof(name), "%s-%02d-sw-reproject", lv.name, p);
+            ray_kernel = KERNEL_SCALAR;
+            r->indexed = false;
+            r->camera = make_camera(pose.x, pose.y, pose.angle + REGRESS_TURN);
+            r->column_cache.valid = false;
+            render_frame(*r, &render_pool);
+            frame_rgb(*r, reference);
+            r->reproject = true;
+            r->camera = make_camera(pose.x, pose.y, pose.angle);
+            r->column_cache.valid = false;
+            render_frame(*r, &render_pool);
+            r->camera = make_camera(pose.x, pose.y, pose.angle + REGRESS_TURN);
+            render_frame(*r, &render_pool);
+            r->reproject = false;
+            frame_rgb(*r, frame);
+            check(*r, reference, "casting every column", name, REGRESS_REPROJECT_DIFFERING);
+
+            if (p != lv.split_pose) continue;
+            tile_cols = TILE_COLS;
+            tile_rows = TILE_ROWS;
+            view = make_camera(pose.x, pose.y, pose.angle);
+            backend = BACKEND_SOFTWARE;
+            view_layout = VIEWS_SPLIT;
+            reproject_columns = false;
+            std::unique_ptr<Renderer> whole(new Renderer()); // the slot's whole frame, to compare
+            FOR(indexed, 2) {
+                indexed_color = indexed != 0;
+                FOR(v, 2) game_views[v].column_cache.valid = false;
+                render_world(frame_slots[0]);
+                set_view_target(*whole, frame_slots[0], 0, tile_cols);
+                whole->indexed = indexed_color;
+                frame_rgb(*whole, frame);
+                snprintf(name, sizeof(name), "%s-%02d-split-%s", lv.name, p, indexed ? "sw8" : "sw");
+                if (!check_golden(*whole, name)) return 1;
             }
+            view_layout = VIEWS_SINGLE;
+            indexed_color = false;
         }
     }
 
-    //// sprites
-    // Sort by decreasing depth
-    for (auto & e : entities) {
-        e.scene_coords = world_to_scene(e.world_coords());
-    }
-    std::sort(BEND(entities), [](Entity const & a, Entity const & b) { return a.scene_coords.z > b.scene_coords.z; });
-
-    for (auto & e : entities) {
-        if (e.scene_coords.z > EPS) {
-            SceneRect ent_rect_scene;
-            ent_rect_scene.z = e.scene_coords.z;
-            ent_rect_scene.x = e.scene_coords.x - e.width_scene/2.0;
-            ent_rect_scene.y = e.scene_coords.y - e.height_scene;
-            ent_rect_scene.w = e.width_scene;
-            ent_rect_scene.h = e.height_scene;
-
-            ViewRect ent_rect_view = scene_to_view(ent_rect_scene);
-            SDL_Rect ent_rect_sdl = view_to_sdl(ent_rect_view);
-
-            FOR(x_offset, ent_rect_sdl.w) {
-                int x = ent_rect_sdl.x + x_offset;
-                if (x < 0 || TILE_COLS <= x || column_dist[x] < ent_rect_scene.z) continue;
-
-                double c_x = x_offset + 0.5;
-                double c_u = c_x * e.sprite_w / ent_rect_sdl.w;
-                int u = static_cast<int>(round(c_u - 0.5));
-                u = std::max(0, std::min(u, e.sprite_w-1));
+    failures += regress_queries();
+
+    printf("regress: real=%s threads=%d, %dx%d\n", real_name(), render_pool.size(), TILE_COLS, TILE_ROWS);
+    for (RegressTiming const & t : timings) {
+        RegressTiming const * base = find_timing(baseline, t.level, t.variant);
+        const char * slow = regress_slowdown(t, baseline, timings);
+        printf("  %-8s %-11s %7.2f ms", t.level.c_str(), t.variant.c_str(), t.ms);
+        if (base) printf(", baseline %.2f ms", base->ms);
+        if (slow) printf(": FAIL, %s", slow);
+        printf("\n");
+        if (slow) ++failures;
+    }
 
-                map_texture_column(e.sprite, u, x, ent_rect_view.y, ent_rect_view.y + ent_rect_view.h);
-            }
+    snprintf(path, sizeof(path), "%s/last-timings.txt", dir);
+    if (!write_regress_timings(path, timings)) {
+        fprintf(stderr, "Couldn't write %s\n", path);
+        return 1;
+    }
+    if (update == REGRESS_UPDATE_GOLDENS) printf("regress: recorded %d goldens in %s\n", goldens, dir);
+    if (update == REGRESS_UPDATE_TIMINGS) {
+        // a baseline is only worth keeping from a tree that draws right
+        snprintf(path, sizeof(path), "%s/timings.txt", dir);
+        if (failures) printf("regress: not recording the timings while frames fail\n");
+        else if (!write_regress_timings(path, timings)) {
+            fprintf(stderr, "Couldn't write %s\n", path);
+            return 1;
         }
+        else printf("regress: recorded the timings in %s\n", path);
     }
+    printf("regress: %d frames checked, %d failure%s\n", frames, failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
 
-    //// mini-map
-    FOR(y,MAP_HEIGHT) {
-        FOR(x,MAP_WIDTH) {
-            if (map_grid[y][x] == '#') {
-                CHECK_SDL(SDL_SetRenderDrawColor(ren, 255, 255, 255, 255));
+// Dynamic resolution
+// With --resolution=auto, the default outside the benchmark, the internal
+// resolution follows a frame budget. Every RES_SETTLE_FRAMES frames drawn at
+// one resolution, if their mean work time is over budget or well under it,
+// the column count is scaled by the square root of (target / work), since the
+// work goes with the pixel count. Work is the world and HUD phases; waiting on
+// vsync or the frame cap doesn't count.
+const int RES_STEP = 16; // columns change in multiples of this, which any SIMD width divides
+const int MIN_COLS = 64;
+const int RES_SETTLE_FRAMES = 30;
+const double RES_TARGET = 0.8; // of the budget, leaving headroom for spikes
+
+bool dynamic_resolution = true;
+double frame_budget_ms = 1000.0 / 60;
+int res_frames;
+double res_work_ms;
+
+void set_resolution(int cols)
+{
+    tile_cols = std::max(MIN_COLS, std::min(cols / RES_STEP * RES_STEP, TILE_COLS));
+    tile_rows = tile_cols * TILE_ROWS / TILE_COLS;
+    res_frames = 0;
+    res_work_ms = 0;
+}
+
+void update_resolution()
+{
+    if (!dynamic_resolution) return;
+    FR(p, PHASE_FLOOR, PHASE_PRESENT) res_work_ms += phase_ms[p];
+    if (++res_frames < RES_SETTLE_FRAMES) return;
+
+    double work_ms = res_work_ms / res_frames;
+    res_frames = 0;
+    res_work_ms = 0;
+    if (work_ms <= 0 || (work_ms < frame_budget_ms && work_ms > frame_budget_ms * RES_TARGET * 0.75)) return;
+
+    double scale = std::sqrt(frame_budget_ms * RES_TARGET / work_ms);
+    scale = std::max(0.7, std::min(scale, 1.25));
+    int cols = static_cast<int>(tile_cols * scale);
+    // round towards the change so small corrections still take a step
+    cols = scale > 1 ? cols + RES_STEP - 1 : cols;
+    set_resolution(cols);
+}
+
+// Pipelined rendering
+// With --pipeline, the software backend draws frame N+1 on a render thread
+// while the main thread uploads and presents frame N from the other slot.
+// The threads hand frames over through one atomic state word. The render
+// thread only runs between a kick and the main thread's next collect, and
+// the main thread only simulates, handles input and switches settings
+// outside that window, so the world needs no locks. The SDL backend and the
+// benchmark render in lockstep.
+//
+// Collecting a frame before the next simulation step leaves nothing for a
+// third slot to hold: that would need the render thread to run ahead of the
+// simulation on a snapshot of the world.
+enum RenderState { RENDER_IDLE, RENDER_QUEUED, RENDER_DONE, RENDER_STOP };
+
+struct RenderThread
+{
+    std::thread thread;
+    std::atomic<int> state;
+    int slot;       // slot being drawn, from kick() until collect()
+    int ready_slot; // last collected slot, or -1 before the first frame
+
+    RenderThread() : state(RENDER_IDLE), slot(0), ready_slot(-1) {}
+
+    bool running() const
+    {
+        return thread.joinable();
+    }
+
+    // Wait until `state` isn't `value`. The other side is usually close to
+    // done, so spin a little, then nap so a long wait costs no CPU.
+    int wait_while(int value)
+    {
+        for (int spins = 0; ; ++spins) {
+            int s = state.load(std::memory_order_acquire);
+            if (s != value) return s;
+            if (spins < 64) {
+                std::this_thread::yield();
             } else {
-                CHECK_SDL(SDL_SetRenderDrawColor(ren, 0, 0, 0, 255));
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
             }
+        }
+    }
+
+    void start()
+    {
+        if (!HAVE_THREADS || running()) return;
+        thread = std::thread([this] { main(); });
+    }
+
+    void stop()
+    {
+        if (!running()) return;
+        wait_while(RENDER_QUEUED);
+        state.store(RENDER_STOP, std::memory_order_release);
+        thread.join();
+    }
+
+    // Start drawing the current view into the slot not on screen.
+    void kick(Uint64 input_time)
+    {
+        slot = ready_slot == 0 ? 1 : 0;
+        frame_slots[slot].input_time = input_time;
+        state.store(RENDER_QUEUED, std::memory_order_release);
+    }
 
-            drawtile(TILE_COLS - MAP_WIDTH + x, y);
+    // Wait for the frame in flight, if any; true if there's a frame to present.
+    bool collect()
+    {
+        if (state.load(std::memory_order_acquire) != RENDER_IDLE) {
+            wait_while(RENDER_QUEUED);
+            state.store(RENDER_IDLE, std::memory_order_relaxed);
+            ready_slot = slot;
         }
+        return ready_slot >= 0;
     }
-    int minimap_x = static_cast<int>(player_x);
-    int minimap_y = static_cast<int>(player_y);
-    if (0 <= minimap_x && minimap_x < MAP_WIDTH && 0 <= minimap_y && minimap_y < MAP_HEIGHT) {
-        CHECK_SDL(SDL_SetRenderDrawColor(ren, 150, 63, 255, 255));
-        drawtile(TILE_COLS - MAP_WIDTH + minimap_x, minimap_y);
+
+    void main()
+    {
+        worker_index = render_pool.size();
+        for (;;) {
+            int s = state.load(std::memory_order_acquire);
+            if (s == RENDER_STOP) return;
+            if (s != RENDER_QUEUED) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            render_world(frame_slots[slot]);
+            state.store(RENDER_DONE, std::memory_order_release);
+        }
     }
+};
+RenderThread render_thread;
 
-    //// scale up
-    CHECK_SDL(SDL_SetRenderTarget(ren, NULL));
-    CHECK_SDL(SDL_RenderCopy(ren, pixel_screen.get(), NULL, NULL));
+void stop_render_thread()
+{
+    render_thread.stop();
+}
 
-    //// diagnostics
-    CHECK_SDL(SDL_SetRenderDrawColor(ren, 255, 255, 255, 255));
-    char buf[256];
+// Frame pacing
+// The simulation advances in fixed SIM_STEP_S steps, as many per frame as the
+// real time since the last frame pays for. Whatever is left in the
+// accumulator blends the poses of the last two steps for rendering, so motion
+// stays smooth at any frame rate. The present mode decides how the native
+// loop waits between frames: for vsync inside SDL_RenderPresent, not at all,
+// or until a fixed deadline. The browser paces the web build itself.
+const double SIM_STEP_S = 1.0 / 120;
+const double MAX_FRAME_S = 0.25; // longer stalls (breakpoints, window drags) drop sim time
+double sim_accumulator_s;
+
+struct PlayerPose
+{
+    double x, y;
+    double angle;
+};
+PlayerPose prev_pose;
 
-    snprintf(buf, sizeof(buf),
-        "X=%.2lf, Y=%.2lf, A=%.2lf, dX=%.2lf, dY=%.2lf ;  X=%.2lf, Y=%.2lf, D=%.2lf ;  t=%.1lf ms",
-        player_x, player_y, player_angle, player_dx, player_dy,
-        straight_x, straight_y, straight_dist,
-        avgFrameTime_ms());
-    DrawText(ren, font, buf, {255, 255, 255, 255}, 0, 0, NULL, NULL, false);
+PlayerPose player_pose()
+{
+    PlayerPose pose = { player_x, player_y, player_angle };
+    return pose;
+}
 
-    SDL_RenderPresent(ren);
+void set_view(PlayerPose const & pose)
+{
+    set_view(pose.x, pose.y, pose.angle);
+}
+
+PlayerPose lerp_pose(PlayerPose const & a, PlayerPose const & b, double t)
+{
+    // turn the short way round
+    double turn = b.angle - a.angle;
+    if (turn > 0.5) turn -= 1;
+    if (turn < -0.5) turn += 1;
+
+    PlayerPose pose = { a.x + (b.x - a.x)*t, a.y + (b.y - a.y)*t, a.angle + turn*t };
+    wrap_angle(pose.angle);
+    return pose;
+}
+
+Uint64 next_present;
+
+// Sleep until the performance counter reaches `deadline`. SDL_Delay can
+// overshoot by a scheduler tick, so it only covers all but the last couple of
+// milliseconds and the rest is spent yielding.
+void wait_until(Uint64 deadline)
+{
+    for (;;) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline) return;
+        double left_ms = counter_to_ms(deadline - now);
+        if (left_ms > 2) {
+            SDL_Delay(static_cast<Uint32>(left_ms - 2));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void pace_frame()
+{
+    if (present_mode != PRESENT_CAPPED) return;
+
+    Uint64 period = static_cast<Uint64>(SDL_GetPerformanceFrequency() / capped_fps);
+    Uint64 now = SDL_GetPerformanceCounter();
+    // after falling more than a frame behind, start over rather than rush
+    // to catch up
+    if (next_present == 0 || now > next_present + period) next_present = now;
+    next_present += period;
+    wait_until(next_present);
 }
 
-Uint32 prevFrame_ms;
 void main_loop()
 {
-    Uint32 thisFrame_ms = SDL_GetTicks();
-    Uint32 deltaFrame_ms = thisFrame_ms - prevFrame_ms;
-    accumTime(deltaFrame_ms);
-    deltaFrame_s = deltaFrame_ms / 1000.0;
-    update();
-    render();
+    unsigned long allocs = heap_allocations.load(std::memory_order_relaxed);
+    frame_allocations = allocs - frame_allocations_mark;
+    frame_allocations_mark = allocs;
+
+    Uint64 thisFrame = SDL_GetPerformanceCounter();
+    double deltaFrame_ms = counter_to_ms(thisFrame - prevFrame);
+    prevFrame = thisFrame;
+
+    // the render thread has to be parked before anything else is touched
+    bool have_frame = render_thread.collect();
+    bool pipelined = pipeline_frames && render_thread.running() && backend == BACKEND_SOFTWARE;
+    if (pipelined && have_frame) {
+        end_profile_frame(deltaFrame_ms);
+        update_resolution();
+    }
+
+    Uint64 input_time = SDL_GetPerformanceCounter();
+    handle_events();
+    sim_accumulator_s += std::min(deltaFrame_ms / 1000.0, MAX_FRAME_S);
+    deltaFrame_s = SIM_STEP_S;
+    while (sim_accumulator_s >= SIM_STEP_S) {
+        prev_pose = player_pose();
+        update();
+        sim_accumulator_s -= SIM_STEP_S;
+    }
+
+    set_view(lerp_pose(prev_pose, player_pose(), sim_accumulator_s / SIM_STEP_S));
+    if (pipelined && backend == BACKEND_SOFTWARE) { // backend may have just changed
+        FrameSlot const & shown = frame_slots[std::max(render_thread.ready_slot, 0)];
+        render_thread.kick(input_time);
+        if (have_frame) present_frame(shown);
+    } else {
+        frame_slots[0].input_time = input_time;
+        render_thread.ready_slot = -1;
+        render();
+        if (!pipelined) {
+            end_profile_frame(deltaFrame_ms);
+            update_resolution();
+        }
+    }
+
+#ifndef __EMSCRIPTEN__
+    pace_frame();
+#endif
+}
 
-    prevFrame_ms = thisFrame_ms;
+// Value of a --name=value option, or NULL if arg isn't that option.
+const char * option_value(const char * arg, const char * name)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') return NULL;
+    return arg + len + 1;
+}
+
+void usage(const char * prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --bench             fly the benchmark camera path and print frame timings\n"
+        "  --frames=N          benchmark length (default: one pass over the path)\n"
+        "  --csv=PATH          write per-frame benchmark timings as CSV\n"
+        "  --json=PATH         write the benchmark summary as JSON\n"
+        "  --headless          don't show the window\n"
+        "  --backend=sdl|sw|sw8  renderer backend; sw8 is software with indexed colour\n"
+        "  --kernel=scalar|simd  ray-casting kernel\n"
+        "  --threads=N         render threads, including the main one\n"
+        "  --present=vsync|uncapped|capped  frame pacing (the benchmark is always uncapped)\n"
+        "  --resolution=auto|N internal resolution N columns wide, or scaled to --budget (default auto;\n"
+        "                      the benchmark uses the largest)\n"
+        "  --budget=MS         frame-time budget for --resolution=auto (default 16.7)\n"
+        "  --pipeline          draw each frame on a render thread while the last one is presented\n"
+        "  --reproject         reuse the last frame's rays when only turning (approximate)\n"
+        "  --views=single|split|mirror  also draw a chase camera beside the player's, or a rear-view mirror\n"
+        "  --fps=N             frame rate for --present=capped (default 60)\n"
+        "  --trace=PATH        capture a Chrome trace of the first frames to PATH\n"
+        "  --level=PATH        play a level file (binary, or text like map_grid)\n"
+        "  --export-level=PATH write the level as a binary level file and exit\n"
+        "  --assets=PATH       asset pack to load (default data/assets.pak, falling back to data/*.png)\n"
+        "  --bake-assets=PATH  write the asset pack and exit\n"
+        "  --batch=PATH        render the camera poses in PATH (lines of x y angle) without a window and exit\n"
+        "  --batch-out=DIR     write the --batch frames to DIR as PPM files\n"
+        "  --regress=DIR       check frames of fixed poses against the goldens and timings in DIR, and exit\n"
+        "  --regress-update=goldens|timings  with --regress, record the goldens or this machine's timings instead\n",
+        prog);
+    exit(1);
 }
 
-int main()
+int main(int argc, char ** argv)
 {
+    bool headless = false;
+    int num_threads = default_thread_count();
+    const char * level_path = NULL;
+    const char * export_path = NULL;
+    const char * assets_path = NULL;
+    const char * bake_path = NULL;
+    const char * batch_path = NULL;
+    const char * batch_out = NULL;
+    const char * regress_dir = NULL;
+    RegressUpdate regress_update = REGRESS_CHECK;
+    int resolution_cols = 0; // 0 for auto
+    FR(i, 1, argc) {
+        const char * arg = argv[i];
+        const char * val;
+        if (strcmp(arg, "--bench") == 0) bench_mode = true;
+        else if (strcmp(arg, "--headless") == 0) headless = true;
+        else if (strcmp(arg, "--pipeline") == 0) pipeline_frames = true;
+        else if (strcmp(arg, "--reproject") == 0) reproject_columns = true;
+        else if ((val = option_value(arg, "--views"))) {
+            if (strcmp(val, "single") == 0) view_layout = VIEWS_SINGLE;
+            else if (strcmp(val, "split") == 0) view_layout = VIEWS_SPLIT;
+            else if (strcmp(val, "mirror") == 0) view_layout = VIEWS_MIRROR;
+            else usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--frames"))) bench_frames = atoi(val);
+        else if ((val = option_value(arg, "--csv"))) bench_csv_path = val;
+        else if ((val = option_value(arg, "--json"))) bench_json_path = val;
+        else if ((val = option_value(arg, "--threads"))) num_threads = std::max(1, atoi(val));
+        else if ((val = option_value(arg, "--level"))) level_path = val;
+        else if ((val = option_value(arg, "--export-level"))) export_path = val;
+        else if ((val = option_value(arg, "--assets"))) assets_path = val;
+        else if ((val = option_value(arg, "--bake-assets"))) bake_path = val;
+        else if ((val = option_value(arg, "--batch"))) batch_path = val;
+        else if ((val = option_value(arg, "--batch-out"))) batch_out = val;
+        else if ((val = option_value(arg, "--regress"))) regress_dir = val;
+        else if ((val = option_value(arg, "--regress-update"))) {
+            if (strcmp(val, "goldens") == 0) regress_update = REGRESS_UPDATE_GOLDENS;
+            else if (strcmp(val, "timings") == 0) regress_update = REGRESS_UPDATE_TIMINGS;
+            else usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--trace"))) {
+            trace_path = val;
+            start_trace();
+        }
+        else if ((val = option_value(arg, "--backend"))) {
+            if (strcmp(val, "sdl") == 0) backend = BACKEND_SDL;
+            else if (strcmp(val, "sw") == 0) backend = BACKEND_SOFTWARE;
+            else if (strcmp(val, "sw8") == 0) {
+                backend = BACKEND_SOFTWARE;
+                indexed_color = true;
+            }
+            else usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--present"))) {
+            if (strcmp(val, "vsync") == 0) present_mode = PRESENT_VSYNC;
+            else if (strcmp(val, "uncapped") == 0) present_mode = PRESENT_UNCAPPED;
+            else if (strcmp(val, "capped") == 0) present_mode = PRESENT_CAPPED;
+            else usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--resolution"))) {
+            if (strcmp(val, "auto") == 0) resolution_cols = 0;
+            else if ((resolution_cols = atoi(val)) <= 0) usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--budget"))) {
+            frame_budget_ms = atof(val);
+            if (!(frame_budget_ms > 0)) usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--fps"))) {
+            capped_fps = atof(val);
+            if (!(capped_fps > 0)) usage(argv[0]);
+        }
+        else if ((val = option_value(arg, "--kernel"))) {
+            if (strcmp(val, "scalar") == 0) ray_kernel = KERNEL_SCALAR;
+            else if (strcmp(val, "simd") == 0 && HAVE_RAY_SIMD) ray_kernel = KERNEL_SIMD;
+            else usage(argv[0]);
+        }
+        else usage(argv[0]);
+    }
+    if (regress_update && !regress_dir) usage(argv[0]);
+    if (bench_frames <= 0) bench_frames = bench_path_frames();
+    if (bench_mode) present_mode = PRESENT_UNCAPPED;
+    if ((bench_mode || batch_path) && resolution_cols == 0) resolution_cols = TILE_COLS;
+    dynamic_resolution = resolution_cols == 0;
+    set_resolution(resolution_cols ? resolution_cols : START_COLS);
+
+    if (!(level_path ? open_level(level_path) : open_builtin_level())) return 1;
+    if (export_path) {
+        if (!export_level(export_path)) {
+            fprintf(stderr, "Couldn't write %s\n", export_path);
+            return 1;
+        }
+        return 0;
+    }
+
     atexit(cleanup);
 
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) failSDL("SDL_Init");
     if (TTF_Init() == -1) failTTF("TTF_Init");
 
     int flags = IMG_INIT_PNG;
     if ((IMG_Init(flags) & flags) != flags) failIMG("IMG_Init");
 
-    font = TTF_OpenFont("data/Vera.ttf", FONT_HEIGHT);
-    if (!font) failTTF("TTF_OpenFont");
+    if (bake_path) {
+        load_asset_files();
+        if (!bake_assets(bake_path)) {
+            fprintf(stderr, "Couldn't write %s\n", bake_path);
+            return 1;
+        }
+        return 0;
+    }
+
+    // the pack is optional unless one was asked for
+    Uint64 assets_start = SDL_GetPerformanceCounter();
+    if (!open_assets(assets_path ? assets_path : DEFAULT_ASSET_PATH)) {
+        if (assets_path) return 1;
+        fprintf(stderr, "Loading the assets from data/ instead\n");
+        load_asset_files();
+        asset_source = "files";
+    }
+    asset_load_ms = counter_to_ms(SDL_GetPerformanceCounter() - assets_start);
+
+    spawn_level();
+
+    render_pool.start(num_threads);
+#ifdef __EMSCRIPTEN__
+    // which build the page picked, and what it found
+    printf("Web build: %d thread%s, %s ray kernel\n", render_pool.size(), render_pool.size() == 1 ? "" : "s", ray_kernel_name());
+#endif
+    if (batch_path) return run_batch(batch_path, batch_out);
+    if (regress_dir) return run_regress(regress_dir, regress_update);
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) failSDL("SDL_Init");
 
     win = SDL_CreateWindow("Retro Ray FPS",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WIN_WIDTH, WIN_HEIGHT, SDL_WINDOW_SHOWN);
+        WIN_WIDTH, WIN_HEIGHT, headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN);
     if (!win) failSDL("SDL_CreateWindow");
 
-    ren = SDL_CreateRenderer(win, -1, 0);
+    ren = SDL_CreateRenderer(win, -1, present_mode == PRESENT_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0);
     if (!ren) failSDL("SDL_CreateRenderer");
 
+#ifndef __EMSCRIPTEN__
+    // not every driver can sync to the display; pace ourselves instead
+    SDL_RendererInfo ren_info;
+    CHECK_SDL(SDL_GetRendererInfo(ren, &ren_info));
+    if (present_mode == PRESENT_VSYNC && !(ren_info.flags & SDL_RENDERER_PRESENTVSYNC)) {
+        fprintf(stderr, "No vsync on renderer %s; capping at %g fps\n", ren_info.name, capped_fps);
+        present_mode = PRESENT_CAPPED;
+    }
+#endif
+
+    assets_start = SDL_GetPerformanceCounter();
+    upload_assets();
+    asset_upload_ms = counter_to_ms(SDL_GetPerformanceCounter() - assets_start);
+
     pixel_screen.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, TILE_COLS, TILE_ROWS));
     if (!pixel_screen) failSDL("SDL_CreateTexture");
 
-    // load textures
-    red_brick.reset(LoadTexture(ren, "data/red_brick.png"));
-    green_brick.reset(LoadTexture(ren, "data/green_brick.png"));
-    red_panel.reset(LoadTexture(ren, "data/red_panel.png"));
-    green_panel.reset(LoadTexture(ren, "data/green_panel.png"));
-    red_2panel.reset(LoadTexture(ren, "data/red_2panel.png"));
-    green_2panel.reset(LoadTexture(ren, "data/green_2panel.png"));
-    frog_sprite.reset(LoadTexture(ren, "data/frog.png"));
+    framebuffer_tex.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, TILE_COLS, TILE_ROWS));
+    if (!framebuffer_tex) failSDL("SDL_CreateTexture");
+
+    minimap_tex.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, MINIMAP_SIZE, MINIMAP_SIZE));
+    if (!minimap_tex) failSDL("SDL_CreateTexture");
+
+    hud_layer.reset(SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, WIN_WIDTH, 2 * glyph_atlas.line_skip));
+    if (!hud_layer) failSDL("SDL_CreateTexture");
+    CHECK_SDL(SDL_SetTextureBlendMode(hud_layer.get(), SDL_BLENDMODE_BLEND));
 
     // init game
-    player_x = 1.5;
-    player_y = 14.5;
-    player_angle = 0;
+    player_x = level.header.player_x;
+    player_y = level.header.player_y;
+    player_angle = level.header.player_angle;
+    prev_pose = player_pose();
 
-    FOR(y,MAP_HEIGHT) {
-        FOR(x,MAP_HEIGHT) {
-            if (map_grid[y][x] == 'f') {
-                entities.push_back(Entity(*frog_sprite, x + 0.5, y + 0.5));
-            }
-        }
-    }
+    if (pipeline_frames && !bench_mode) render_thread.start();
 
     // IO loop
-    prevFrame_ms = SDL_GetTicks();
+    prevFrame = SDL_GetPerformanceCounter();
     quitRequested = false;
 
 #ifdef __EMSCRIPTEN__
-    emscripten_set_main_loop(main_loop, 0, 0);
+    emscripten_set_main_loop(bench_mode ? bench_step : main_loop, 0, 0);
 #else
     while (!quitRequested) {
-        main_loop();
+        if (bench_mode) bench_step();
+        else main_loop();
     }
+    if (!bench_mode) printf("latency: %.1f ms, mean of the last %d frames\n", avgLatency_ms(), int(std::min(latency_times.held(), FRAME_AVG_LEN)));
 #endif
 
-    return 0;
+    return bench_failed ? 1 : 0;
 }
@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+# Serve this directory cross-origin isolated, so the threaded build can run:
+#   python3 web/serve.py [port]
+import functools
+import http.server
+import os
+import sys
+
+
+class IsolatedHandler(http.server.SimpleHTTPRequestHandler):
+    def end_headers(self):
+        self.send_header('Cross-Origin-Opener-Policy', 'same-origin')
+        self.send_header('Cross-Origin-Embedder-Policy', 'require-corp')
+        super().end_headers()
+
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 8000
+handler = functools.partial(IsolatedHandler, directory=os.path.dirname(os.path.abspath(__file__)))
+print('Serving on http://localhost:%d/' % port)
+http.server.ThreadingHTTPServer(('', port), handler).serve_forever()